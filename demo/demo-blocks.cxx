@@ -0,0 +1,368 @@
+#include <asdf/asdf.hxx>
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace ASDF;
+
+void write_delta() {
+  std::cout << "writing arrays as deltas...\n";
+
+  // Only a few values change from one snapshot to the next
+  std::vector<float64_t> rho0(10000), rho1(10000), rho2(10000);
+  for (size_t i = 0; i < rho0.size(); ++i)
+    rho0[i] = std::sqrt(float64_t(i));
+  rho1 = rho0;
+  for (size_t i = 0; i < rho1.size(); i += 100)
+    rho1[i] += 1;
+  rho2 = rho1;
+  for (size_t i = 50; i < rho2.size(); i += 100)
+    rho2[i] += 1;
+
+  const auto make_array = [](const std::vector<float64_t> &data) {
+    return make_shared<ndarray>(data, block_format_t::block,
+                                compression_t::zlib, 9, std::vector<bool>(),
+                                std::vector<int64_t>{int64_t(data.size())});
+  };
+  {
+    auto grp = make_shared<group>();
+    grp->emplace("rho", make_array(rho0));
+    asdf(map<string, string>(), grp).write("delta-0.asdf");
+  }
+  {
+    // One base in an earlier file, one in the same file
+    const auto base0 = make_array(rho0);
+    const auto arr1 = make_array(rho1);
+    arr1->set_delta_base(base0, reference("delta-0.asdf", {"rho"}));
+    const auto arr2 = make_array(rho2);
+    arr2->set_delta_base(arr1, reference("", {"rho1"}));
+    auto grp = make_shared<group>();
+    grp->emplace("rho1", arr1);
+    grp->emplace("rho2", arr2);
+    asdf(map<string, string>(), grp).write("delta-1.asdf");
+  }
+
+  const asdf base("delta-0.asdf");
+  const asdf project("delta-1.asdf");
+  const auto arr1 = project.get_group()->at("rho1")->get_maybe_ndarray();
+  const auto arr2 = project.get_group()->at("rho2")->get_maybe_ndarray();
+  if (!arr1->get_delta_base() ||
+      arr1->get_data_vector<float64_t>() != rho1 ||
+      arr2->get_data_vector<float64_t>() != rho2) {
+    std::cerr << "Delta-encoded arrays are incorrect\n";
+    std::exit(1);
+  }
+  const auto full_size = base.get_group()
+                             ->at("rho")
+                             ->get_maybe_ndarray()
+                             ->get_block_info()
+                             ->used_space;
+  if (arr1->get_block_info()->used_space >= full_size / 4) {
+    std::cerr << "Delta encoding did not reduce the size\n";
+    std::exit(1);
+  }
+
+  // The base is read from a file where it shares a block with another array
+  const std::vector<float64_t> small0(rho0.begin(), rho0.begin() + 100);
+  std::vector<float64_t> small1 = small0;
+  small1[10] += 1;
+  {
+    auto grp = make_shared<group>();
+    grp->emplace("a", make_array(rho1));
+    grp->emplace("b", make_array(small0));
+    grp->emplace("c", make_array(small0));
+    writer_options options;
+    options.pack_threshold = 1024;
+    asdf(map<string, string>(), grp).write("delta-packed.asdf", options);
+  }
+  {
+    const asdf packed("delta-packed.asdf");
+    const auto packed_base = packed.get_group()->at("c")->get_maybe_ndarray();
+    if (packed_base->get_offset() == 0) {
+      std::cerr << "Delta base was not packed\n";
+      std::exit(1);
+    }
+    const auto arr = make_array(small1);
+    arr->set_delta_base(packed_base, reference("delta-packed.asdf", {"c"}));
+    auto grp = make_shared<group>();
+    grp->emplace("small", arr);
+    asdf(map<string, string>(), grp).write("delta-2.asdf");
+  }
+  const asdf project2("delta-2.asdf");
+  if (project2.get_group()
+          ->at("small")
+          ->get_maybe_ndarray()
+          ->get_data_vector<float64_t>() != small1) {
+    std::cerr << "Delta relative to a packed array is incorrect\n";
+    std::exit(1);
+  }
+}
+
+void write_deduplicated() {
+  std::cout << "deduplicating blocks...\n";
+
+  std::vector<float64_t> coords(10000);
+  for (size_t i = 0; i < coords.size(); ++i)
+    coords[i] = i;
+  const auto make_array = [&]() {
+    return make_shared<ndarray>(coords, block_format_t::block,
+                                compression_t::none, 0, std::vector<bool>(),
+                                std::vector<int64_t>{int64_t(coords.size())});
+  };
+  // x and y share their data; z has the same data, but not shared
+  const auto x = make_array();
+  auto grp = make_shared<group>();
+  grp->emplace("x", x);
+  grp->emplace("y", make_shared<ndarray>(*x));
+  grp->emplace("z", make_array());
+  const asdf project(map<string, string>(), grp);
+
+  writer_options options;
+  project.write("dedup-shared.asdf", options);
+  options.deduplicate_blocks = true;
+  project.write("dedup-content.asdf", options);
+
+  const auto get_source = [](const asdf &project, const string &name) {
+    return project.get_group()->at(name)->get_maybe_ndarray()->get_source();
+  };
+  const asdf shared("dedup-shared.asdf");
+  const asdf content("dedup-content.asdf");
+  if (get_source(shared, "x") != get_source(shared, "y") ||
+      get_source(shared, "x") == get_source(shared, "z") ||
+      get_source(content, "x") != get_source(content, "z")) {
+    std::cerr << "Blocks were not deduplicated\n";
+    std::exit(1);
+  }
+  for (const string name : {"x", "y", "z"}) {
+    if (content.get_group()
+            ->at(name)
+            ->get_maybe_ndarray()
+            ->get_data_vector<float64_t>() != coords) {
+      std::cerr << "Deduplicated array is incorrect\n";
+      std::exit(1);
+    }
+  }
+
+  // Arrays read from a file are decoded only once, although their data are
+  // hashed before their blocks are written
+  struct counting_allocator_t : block_allocator_t {
+    std::atomic<int64_t> count{0};
+    virtual void *allocate(size_t nbytes) override {
+      ++count;
+      return ::operator new(nbytes);
+    }
+    virtual void deallocate(void *ptr, size_t nbytes) override {
+      ::operator delete(ptr);
+    }
+  };
+  {
+    std::vector<float64_t> other = coords;
+    other[0] = -1;
+    auto grp = make_shared<group>();
+    for (const auto &[name, data] : {std::make_pair("u", coords),
+                                     std::make_pair("v", other)})
+      grp->emplace(name, make_shared<ndarray>(
+                             data, block_format_t::block, compression_t::zlib,
+                             9, std::vector<bool>(),
+                             std::vector<int64_t>{int64_t(data.size())}));
+    asdf(map<string, string>(), grp).write("dedup-zlib.asdf");
+  }
+  const auto allocator = make_shared<counting_allocator_t>();
+  reader_options read_options;
+  read_options.allocator = allocator;
+  {
+    const asdf file("dedup-zlib.asdf", {}, read_options);
+    const auto arr = file.get_group()->at("u")->get_maybe_ndarray();
+    arr->get_data_vector<float64_t>();
+  }
+  const int64_t allocations_per_array = allocator->count;
+  allocator->count = 0;
+  {
+    const asdf file("dedup-zlib.asdf", {}, read_options);
+    file.write("dedup-rewritten.asdf", options);
+    if (allocator->count != 2 * allocations_per_array ||
+        file.get_group()->at("u")->get_maybe_ndarray()->get_data().ready()) {
+      std::cerr << "Deduplicated arrays were decoded more than once\n";
+      std::exit(1);
+    }
+  }
+}
+
+void write_packed() {
+  std::cout << "packing small arrays...\n";
+
+  // Many small arrays of different types and sizes
+  const int narrays = 1000;
+  auto grp = make_shared<group>();
+  for (int n = 0; n < narrays; ++n) {
+    const string name = "a" + std::to_string(n);
+    if (n % 2 == 0) {
+      std::vector<int32_t> values(n % 7 + 1);
+      for (size_t i = 0; i < values.size(); ++i)
+        values[i] = n + i;
+      grp->emplace(name, make_shared<ndarray>(
+                             values, block_format_t::block,
+                             compression_t::zlib, 9, std::vector<bool>(),
+                             std::vector<int64_t>{int64_t(values.size())}));
+    } else {
+      std::vector<float64_t> values(n % 5 + 1);
+      for (size_t i = 0; i < values.size(); ++i)
+        values[i] = n + i / 2.0;
+      grp->emplace(name, make_shared<ndarray>(
+                             values, block_format_t::block,
+                             compression_t::zlib, 9, std::vector<bool>(),
+                             std::vector<int64_t>{int64_t(values.size())}));
+    }
+  }
+  const asdf project(map<string, string>(), grp);
+
+  writer_options options;
+  project.write("unpacked.asdf", options);
+  options.pack_threshold = 1024;
+  options.pack_block_size = 16 * 1024;
+  project.write("packed.asdf", options);
+
+  const auto file_size = [](const string &filename) {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    return int64_t(file.tellg());
+  };
+  const asdf packed("packed.asdf");
+  std::set<int64_t> sources;
+  for (int n = 0; n < narrays; ++n) {
+    const auto arr =
+        packed.get_group()->at("a" + std::to_string(n))->get_maybe_ndarray();
+    sources.insert(arr->get_source());
+    bool correct = true;
+    if (n % 2 == 0) {
+      const auto values = arr->get_data_vector<int32_t>();
+      correct = int(values.size()) == n % 7 + 1;
+      for (size_t i = 0; i < values.size(); ++i)
+        correct &= values[i] == int32_t(n + i);
+    } else {
+      const auto values = arr->get_data_vector<float64_t>();
+      correct = int(values.size()) == n % 5 + 1;
+      for (size_t i = 0; i < values.size(); ++i)
+        correct &= values[i] == n + i / 2.0;
+    }
+    if (!correct) {
+      std::cerr << "Packed array is incorrect\n";
+      std::exit(1);
+    }
+  }
+  if (sources.size() > 10 ||
+      file_size("packed.asdf") >= file_size("unpacked.asdf")) {
+    std::cerr << "Arrays were not packed\n";
+    std::exit(1);
+  }
+
+  // Without a threshold, not even empty arrays are packed
+  auto empty_grp = make_shared<group>();
+  for (const string name : {"e0", "e1"})
+    empty_grp->emplace(name, make_shared<ndarray>(
+                                 std::vector<int32_t>(), block_format_t::block,
+                                 compression_t::none, 0, std::vector<bool>(),
+                                 std::vector<int64_t>{0}));
+  asdf(map<string, string>(), empty_grp).write("unpacked-empty.asdf");
+  const asdf unpacked_empty("unpacked-empty.asdf");
+  if (unpacked_empty.get_group()->at("e0")->get_maybe_ndarray()->get_source() ==
+      unpacked_empty.get_group()->at("e1")->get_maybe_ndarray()->get_source()) {
+    std::cerr << "Empty arrays were packed\n";
+    std::exit(1);
+  }
+}
+
+void read_empty_chunks() {
+  std::cout << "reading an empty array at an offset in chunks...\n";
+
+  // Packing places the empty array after the other array's data
+  auto grp = make_shared<group>();
+  grp->emplace("data", make_shared<ndarray>(std::vector<int64_t>{1, 2, 3},
+                                            block_format_t::block,
+                                            compression_t::none, 0,
+                                            std::vector<bool>(),
+                                            std::vector<int64_t>{3}));
+  grp->emplace("empty", make_shared<ndarray>(std::vector<int64_t>(),
+                                             block_format_t::block,
+                                             compression_t::none, 0,
+                                             std::vector<bool>(),
+                                             std::vector<int64_t>{0, 3}));
+  writer_options options;
+  options.pack_threshold = 1024;
+  asdf(map<string, string>(), grp).write("empty-packed.asdf", options);
+
+  const asdf project("empty-packed.asdf");
+  const auto arr = project.get_group()->at("empty")->get_maybe_ndarray();
+  if (arr->get_offset() == 0) {
+    std::cerr << "Empty array was not packed\n";
+    std::exit(1);
+  }
+  auto chunks = arr->get_chunks(4);
+  if (chunks.next()) {
+    std::cerr << "Empty array has chunks\n";
+    std::exit(1);
+  }
+}
+
+void write_temporaries() {
+  std::cout << "writing temporary arrays...\n";
+
+  // The arrays are destroyed before the writer is flushed, and their memory
+  // may be reused by the next array. Pairs of arrays have the same data.
+  const auto make_array = [](int64_t value) {
+    return make_shared<ndarray>(std::vector<int64_t>(100, value),
+                                block_format_t::block, compression_t::none, 0,
+                                std::vector<bool>(),
+                                std::vector<int64_t>{100});
+  };
+  // Small arrays are also written into shared blocks
+  for (const int64_t pack_threshold : {0, 1024}) {
+    writer_options options;
+    options.deduplicate_blocks = true;
+    options.pack_threshold = pack_threshold;
+    {
+      std::ofstream os("temporaries.asdf", ios::binary | ios::out);
+      writer w(os, map<string, string>(), options);
+      w << YAML::LocalTag("core/asdf-1.1.0") << YAML::BeginMap;
+      for (int n = 0; n < 10; ++n)
+        w << YAML::Key << "t" + std::to_string(n) << YAML::Value
+          << *make_array(n / 2);
+      w << YAML::EndMap;
+      w.flush();
+    }
+    const asdf project("temporaries.asdf");
+    for (int n = 0; n < 10; ++n) {
+      if (project.get_group()
+              ->at("t" + std::to_string(n))
+              ->get_maybe_ndarray()
+              ->get_data_vector<int64_t>() !=
+          std::vector<int64_t>(100, n / 2)) {
+        std::cerr << "Temporary array is incorrect\n";
+        std::exit(1);
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  cout << "asdf-demo-blocks: Share, delta-encode, and pack blocks\n";
+  ASDF_CHECK_VERSION();
+
+  write_delta();
+  write_deduplicated();
+  write_packed();
+  read_empty_chunks();
+  write_temporaries();
+
+  std::cout << "Done.\n";
+  return 0;
+}
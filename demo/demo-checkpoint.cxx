@@ -0,0 +1,232 @@
+#include <asdf/asdf.hxx>
+#include <asdf/checkpoint.hxx>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+using namespace ASDF;
+
+void write_checkpoints() {
+  std::cout << "writing checkpoints in the background...\n";
+
+  // The array refers to the simulation's data without copying them
+  std::vector<int64_t> data(100000);
+  const auto arr = make_shared<ndarray>(
+      make_constant_memoized(
+          std::shared_ptr<block_t>(make_shared<ptr_block_t>(data))),
+      std::optional<block_info_t>(), block_format_t::block,
+      compression_t::zlib, 1, std::vector<bool>(),
+      make_shared<datatype_t>(id_int64), host_byteorder(),
+      std::vector<int64_t>{int64_t(data.size())});
+  auto grp = make_shared<group>();
+  grp->emplace("data", arr);
+  const asdf project(map<string, string>(), grp);
+
+  std::atomic<int> ndone(0);
+  std::vector<std::shared_ptr<const checkpoint_status_t>> statuses;
+  {
+    writer_options options;
+    options.sync = true;
+    checkpoint_writer_t checkpoints(
+        options, 2, [&](const checkpoint_status_t &) { ++ndone; });
+    for (int step = 0; step < 4; ++step) {
+      for (size_t i = 0; i < data.size(); ++i)
+        data[i] = step * i;
+      statuses.push_back(checkpoints.write(
+          project, "checkpoint-" + std::to_string(step) + ".asdf"));
+      // The snapshot is taken; this must not affect the checkpoint
+      std::fill(data.begin(), data.end(), -1);
+      if (checkpoints.get_pending_count() > 2) {
+        std::cerr << "Too many pending checkpoints\n";
+        std::exit(1);
+      }
+    }
+    statuses.front()->wait();
+  }
+  if (ndone != 4) {
+    std::cerr << "Not all checkpoints were reported as done\n";
+    std::exit(1);
+  }
+  for (int step = 0; step < 4; ++step) {
+    const auto &status = statuses.at(step);
+    const asdf checkpoint(status->get_filename());
+    const auto values = checkpoint.get_group()
+                            ->at("data")
+                            ->get_maybe_ndarray()
+                            ->get_data_vector<int64_t>();
+    std::ifstream is(status->get_filename(), ios::binary | ios::ate);
+    if (!status->is_done() || status->get_nbytes_written() != is.tellg()) {
+      std::cerr << "Checkpoint progress is incorrect\n";
+      std::exit(1);
+    }
+    for (size_t i = 0; i < values.size(); ++i) {
+      if (values[i] != int64_t(step * i)) {
+        std::cerr << "Checkpoint data are incorrect\n";
+        std::exit(1);
+      }
+    }
+  }
+
+  // Arrays read from a file: loaded data are copied even if they are then
+  // modified, and data that have not been loaded yet are read before the
+  // checkpoint overwrites the file they are read from
+  std::vector<int64_t> values(1000);
+  for (size_t i = 0; i < values.size(); ++i)
+    values[i] = i;
+  {
+    auto file_grp = make_shared<group>();
+    for (const string name : {"loaded", "lazy"})
+      file_grp->emplace(name, make_shared<ndarray>(
+                                  values, block_format_t::block,
+                                  compression_t::zlib, 9, std::vector<bool>(),
+                                  std::vector<int64_t>{1000}));
+    asdf(map<string, string>(), file_grp).write("checkpoint-read.asdf");
+  }
+  {
+    const asdf file_project("checkpoint-read.asdf");
+    const shared_ptr<block_t> block = file_project.get_group()
+                                          ->at("loaded")
+                                          ->get_maybe_ndarray()
+                                          ->get_data()
+                                          .get();
+    int64_t *const ptr = static_cast<int64_t *>(block->ptr());
+    ptr[0] = 42;
+    checkpoint_writer_t checkpoints{writer_options()};
+    const auto status = checkpoints.write(file_project, "checkpoint-read.asdf");
+    ptr[0] = -1;
+    status->wait();
+  }
+  {
+    const asdf checkpoint("checkpoint-read.asdf");
+    std::vector<int64_t> want = values;
+    want[0] = 42;
+    if (checkpoint.get_group()
+                ->at("loaded")
+                ->get_maybe_ndarray()
+                ->get_data_vector<int64_t>() != want ||
+        checkpoint.get_group()
+                ->at("lazy")
+                ->get_maybe_ndarray()
+                ->get_data_vector<int64_t>() != values) {
+      std::cerr << "Checkpoint of arrays read from a file is incorrect\n";
+      std::exit(1);
+    }
+  }
+}
+
+void write_delta_checkpoints() {
+  std::cout << "writing delta-encoded checkpoints...\n";
+
+  // The base array refers to the simulation's data without copying them
+  std::vector<int64_t> base_data(1000), data(1000);
+  for (size_t i = 0; i < data.size(); ++i) {
+    base_data[i] = i;
+    data[i] = i % 100 == 0 ? -int64_t(i) : int64_t(i);
+  }
+  const auto base = make_shared<ndarray>(
+      make_constant_memoized(
+          std::shared_ptr<block_t>(make_shared<ptr_block_t>(base_data))),
+      std::optional<block_info_t>(), block_format_t::block,
+      compression_t::zlib, 9, std::vector<bool>(),
+      make_shared<datatype_t>(id_int64), host_byteorder(),
+      std::vector<int64_t>{int64_t(base_data.size())});
+  {
+    auto grp = make_shared<group>();
+    grp->emplace("rho", base);
+    asdf(map<string, string>(), grp).write("checkpoint-base.asdf");
+  }
+  const auto arr = make_shared<ndarray>(
+      data, block_format_t::block, compression_t::zlib, 9,
+      std::vector<bool>(), std::vector<int64_t>{int64_t(data.size())});
+  arr->set_delta_base(base, reference("checkpoint-base.asdf", {"rho"}));
+  auto grp = make_shared<group>();
+  grp->emplace("rho", arr);
+  const asdf project(map<string, string>(), grp);
+  {
+    checkpoint_writer_t checkpoints{writer_options()};
+    const auto status = checkpoints.write(project, "checkpoint-delta.asdf");
+    // The snapshot is taken; this must not affect the checkpoint
+    std::fill(base_data.begin(), base_data.end(), -1);
+    status->wait();
+  }
+
+  const asdf checkpoint("checkpoint-delta.asdf");
+  const auto values = checkpoint.get_group()->at("rho")->get_maybe_ndarray();
+  if (!values->get_delta_base() ||
+      values->get_data_vector<int64_t>() != data) {
+    std::cerr << "Delta-encoded checkpoint is incorrect\n";
+    std::exit(1);
+  }
+}
+
+void write_incremental() {
+  std::cout << "writing incremental checkpoints...\n";
+
+  std::vector<int64_t> grid(1000), rho(1000);
+  for (size_t i = 0; i < grid.size(); ++i)
+    grid[i] = i;
+  incremental_writer_t checkpoints;
+  for (int step = 0; step < 3; ++step) {
+    for (size_t i = 0; i < rho.size(); ++i)
+      rho[i] = step * i;
+    auto grp = make_shared<group>();
+    grp->emplace("grid", make_shared<ndarray>(grid, block_format_t::block,
+                                              compression_t::zlib, 9,
+                                              std::vector<bool>(),
+                                              std::vector<int64_t>{1000}));
+    grp->emplace("rho", make_shared<ndarray>(rho, block_format_t::block,
+                                             compression_t::zlib, 9,
+                                             std::vector<bool>(),
+                                             std::vector<int64_t>{1000}));
+    checkpoints.write(asdf(map<string, string>(), grp),
+                      "incremental-" + std::to_string(step) + ".asdf");
+  }
+
+  // The grid is stored only in the first checkpoint
+  const asdf project("incremental-2.asdf");
+  const auto grp = project.get_group();
+  const auto ref = grp->at("grid")->get_maybe_reference();
+  if (!ref || ref->get_target() != "incremental-0.asdf#/grid" ||
+      grp->at("rho")->get_maybe_ndarray()->get_data_vector<int64_t>() !=
+          rho) {
+    std::cerr << "Incremental checkpoint is incorrect\n";
+    std::exit(1);
+  }
+  const auto [rs, node] = ref->resolve();
+  if (ndarray(rs, node).get_data_vector<int64_t>() != grid) {
+    std::cerr << "Referenced array is incorrect\n";
+    std::exit(1);
+  }
+
+  // Fold the references into a standalone copy
+  copy_state cs{false, block_format_t::undefined, false,
+                compression_t::undefined, false, -1};
+  cs.resolve_references = true;
+  const asdf standalone = project.copy(cs);
+  const auto arr = standalone.get_group()->at("grid")->get_maybe_ndarray();
+  if (!arr || arr->get_data_vector<int64_t>() != grid) {
+    std::cerr << "Resolved reference is incorrect\n";
+    std::exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  cout << "asdf-demo-checkpoint: Write ASDF checkpoints\n";
+  ASDF_CHECK_VERSION();
+
+  write_checkpoints();
+  write_delta_checkpoints();
+  write_incremental();
+
+  std::cout << "Done.\n";
+  return 0;
+}
@@ -1,12 +1,17 @@
 #include <asdf/asdf.hxx>
 
-#include <yaml-cpp/yaml.h>
-
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
 using namespace ASDF;
@@ -38,10 +43,8 @@ bool data_equal(const std::vector<int64_t> &shape, const std::vector<T> &data1,
 }
 
 template <typename T>
-void write_file(const std::vector<int64_t> &shape,
-                const std::vector<T> &data3d) {
-  std::cout << "writing file...\n";
-
+std::shared_ptr<asdf> make_project(const std::vector<int64_t> &shape,
+                                   const std::vector<T> &data3d) {
   auto grp = make_shared<group>();
 
   auto array3d_none =
@@ -84,25 +87,92 @@ void write_file(const std::vector<int64_t> &shape,
     grp->emplace("array3d_zlib", array3d_zlib);
   }
 
-  auto project = make_shared<asdf>(map<string, string>(), grp);
+  // Generate data while writing
+  const int64_t row_npoints = shape[1] * shape[2];
+  const row_generator_t generator = [&data3d, row_npoints](
+                                        int64_t begin, int64_t count,
+                                        void *buf) {
+    std::memcpy(buf, &data3d[begin * row_npoints],
+                count * row_npoints * sizeof(T));
+  };
+  const int64_t rows_per_chunk = 10;
+  auto array3d_generated_none = make_shared<ndarray>(
+      generator, rows_per_chunk, block_format_t::block, compression_t::none, 0,
+      make_shared<datatype_t>(get_scalar_type_id<T>()), host_byteorder(),
+      shape);
+  grp->emplace("array3d_generated_none", array3d_generated_none);
+
+  if (have_compression_zlib()) {
+    auto array3d_generated_zlib = make_shared<ndarray>(
+        generator, rows_per_chunk, block_format_t::block, compression_t::zlib,
+        9, make_shared<datatype_t>(get_scalar_type_id<T>()), host_byteorder(),
+        shape);
+    grp->emplace("array3d_generated_zlib", array3d_generated_zlib);
+  }
 
-  project->write("compression.asdf");
+  return make_shared<asdf>(map<string, string>(), grp);
+}
+
+template <typename T>
+void write_file(const std::vector<int64_t> &shape,
+                const std::vector<T> &data3d, const std::string &filename,
+                const writer_options &options = {}) {
+  std::cout << "writing file \"" << filename << "\"...\n";
+
+  const auto project = make_project(shape, data3d);
+  project->write(filename, options);
+  if (options.direct_io)
+    return;
+
+  // Encoding into a preallocated memory region gives the same bytes
+  const size_t nbytes = project->encoded_size();
+  std::vector<char> buffer(nbytes);
+  const size_t nwritten = project->write(buffer.data(), buffer.size());
+  std::ifstream is(filename, ios::binary | ios::in);
+  const std::string contents((std::istreambuf_iterator<char>(is)),
+                             std::istreambuf_iterator<char>());
+  if (nwritten != nbytes || contents != std::string(buffer.data(), nbytes)) {
+    std::cerr << "Encoding into memory differs from file \"" << filename
+              << "\"\n";
+    std::exit(1);
+  }
 }
 
 template <typename T>
 void read_file(const std::vector<int64_t> &shape,
-               const std::vector<T> &data3d) {
-  std::cout << "reading file...\n";
+               const std::vector<T> &data3d, const std::string &filename,
+               const bool direct_io = false, const bool tree_only = false) {
+  std::cout << "reading file \"" << filename << "\"...\n";
 
-  // Read project
-  const std::shared_ptr<asdf> project =
-      std::make_shared<asdf>("compression.asdf");
+  // Read project, allocating the array data with a 64-byte alignment
+  const std::size_t alignment = 64;
+  reader_options options;
+  options.allocator = std::make_shared<aligned_allocator_t>(alignment);
+  options.direct_io = direct_io;
+  // Discover the blocks only when the arrays are accessed
+  options.tree_only = tree_only;
+  const std::shared_ptr<asdf> project = std::make_shared<asdf>(
+      filename, std::map<string, asdf::reader_t>(), options);
   const std::shared_ptr<group> grp = project->get_group();
 
   for (const auto &[k, v] : *grp->get_group())
     std::cout << "[" << k << "]\n";
+
+  // Load all arrays concurrently
+  std::vector<std::thread> threads;
+  for (const auto &[k, v] : *grp->get_group())
+    if (v->get_maybe_ndarray())
+      threads.emplace_back(
+          [arr = v->get_maybe_ndarray()]() { arr->get_data().make_ready(); });
+  for (auto &thread : threads)
+    thread.join();
+
   const std::shared_ptr<ndarray> array3d_none =
       grp->at("array3d_none")->get_maybe_ndarray();
+  if (std::uintptr_t(array3d_none->get_data()->ptr()) % alignment != 0) {
+    std::cerr << "Dataset \"array3d_none\" is not aligned\n";
+    std::exit(1);
+  }
   const std::vector<T> data3d_none = array3d_none->get_data_vector<T>();
   if (!data_equal(shape, data3d, data3d_none)) {
     std::cerr << "Dataset \"array3d_none\" is incorrect\n";
@@ -160,6 +230,198 @@ void read_file(const std::vector<int64_t> &shape,
   }
 }
 
+template <typename T>
+void read_file_batch(const std::vector<int64_t> &shape,
+                     const std::vector<T> &data3d) {
+  std::cout << "reading file in one batch...\n";
+
+  const std::shared_ptr<asdf> project = std::make_shared<asdf>(
+      "compression.asdf", std::map<string, asdf::reader_t>());
+  const std::shared_ptr<group> grp = project->get_group();
+
+  // Read all arrays at once
+  std::vector<std::shared_ptr<ndarray>> arrays;
+  for (const auto &[k, v] : *grp->get_group())
+    if (v->get_maybe_ndarray())
+      arrays.push_back(v->get_maybe_ndarray());
+  ndarray::load_data(arrays);
+
+  for (const auto &[k, v] : *grp->get_group()) {
+    const std::shared_ptr<ndarray> arr = v->get_maybe_ndarray();
+    if (!arr)
+      continue;
+    if (!arr->get_data().ready()) {
+      std::cerr << "Dataset \"" << k << "\" was not loaded\n";
+      std::exit(1);
+    }
+    if (!data_equal(shape, data3d, arr->get_data_vector<T>())) {
+      std::cerr << "Dataset \"" << k << "\" is incorrect\n";
+      std::exit(1);
+    }
+  }
+}
+
+template <typename T>
+void read_file_chunks(const std::vector<int64_t> &shape,
+                      const std::vector<T> &data3d) {
+  std::cout << "reading file in chunks...\n";
+
+  const std::shared_ptr<asdf> project = std::make_shared<asdf>(
+      "compression.asdf", std::map<string, asdf::reader_t>());
+  const std::shared_ptr<group> grp = project->get_group();
+
+  const int64_t row_npoints = shape[1] * shape[2];
+  for (const auto &[k, v] : *grp->get_group()) {
+    const std::shared_ptr<ndarray> arr = v->get_maybe_ndarray();
+    if (!arr)
+      continue;
+    // Use a chunk size that does not divide the number of rows
+    const int64_t rows_per_chunk = 7;
+    int64_t nrows = 0;
+    auto chunks = arr->get_chunks(rows_per_chunk);
+    while (chunks.next()) {
+      const int64_t begin = chunks.get_begin();
+      const int64_t count = chunks.get_count();
+      if (begin != nrows || count > rows_per_chunk ||
+          chunks.nbytes() != count * row_npoints * sizeof(T) ||
+          std::memcmp(chunks.ptr(), &data3d[begin * row_npoints],
+                      chunks.nbytes()) != 0) {
+        std::cerr << "Dataset \"" << k << "\" has incorrect chunks\n";
+        std::exit(1);
+      }
+      nrows += count;
+    }
+    if (nrows != shape[0] || arr->get_data().ready()) {
+      std::cerr << "Dataset \"" << k << "\" was not streamed\n";
+      std::exit(1);
+    }
+  }
+}
+
+template <typename T>
+void read_memory(const std::vector<int64_t> &shape,
+                 const std::vector<T> &data3d) {
+  std::cout << "reading from memory...\n";
+
+  // Load the whole file into memory
+  std::ifstream is("compression.asdf", ios::binary | ios::in);
+  const auto buffer = std::make_shared<std::string>(
+      std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+  const std::shared_ptr<asdf> project = std::make_shared<asdf>(
+      buffer->data(), buffer->size(), buffer);
+  const std::shared_ptr<group> grp = project->get_group();
+
+  for (const auto &[k, v] : *grp->get_group()) {
+    const std::shared_ptr<ndarray> arr = v->get_maybe_ndarray();
+    if (!arr)
+      continue;
+    if (!data_equal(shape, data3d, arr->get_data_vector<T>())) {
+      std::cerr << "Dataset \"" << k << "\" is incorrect\n";
+      std::exit(1);
+    }
+  }
+
+  // Uncompressed data are not copied
+  const std::shared_ptr<ndarray> array3d_none =
+      grp->at("array3d_none")->get_maybe_ndarray();
+  const char *const ptr =
+      static_cast<const char *>(array3d_none->get_data()->ptr());
+  if (!(ptr >= buffer->data() && ptr < buffer->data() + buffer->size())) {
+    std::cerr << "Dataset \"array3d_none\" was copied\n";
+    std::exit(1);
+  }
+}
+
+// A stream buffer that cannot seek, like a pipe
+class pipe_streambuf : public std::streambuf {
+  std::string data;
+  size_t read_pos = 0;
+  std::vector<char> buffer = std::vector<char>(1000);
+
+public:
+  pipe_streambuf() = default;
+  pipe_streambuf(std::string data) : data(std::move(data)) {}
+  const std::string &get_data() const { return data; }
+
+protected:
+  int_type overflow(int_type ch) override {
+    if (ch != traits_type::eof())
+      data.push_back(traits_type::to_char_type(ch));
+    return traits_type::not_eof(ch);
+  }
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    data.append(s, n);
+    return n;
+  }
+  int_type underflow() override {
+    const size_t n = std::min(buffer.size(), data.size() - read_pos);
+    if (n == 0)
+      return traits_type::eof();
+    std::memcpy(buffer.data(), data.data() + read_pos, n);
+    read_pos += n;
+    setg(buffer.data(), buffer.data(), buffer.data() + n);
+    return traits_type::to_int_type(buffer[0]);
+  }
+};
+
+template <typename T>
+void write_read_pipe(const std::vector<int64_t> &shape,
+                     const std::vector<T> &data3d, double block_slack = 0) {
+  std::cout << "writing to and reading from a pipe (block slack "
+            << block_slack << ")...\n";
+
+  // With slack, every block carries padding that the sequential reader
+  // has to skip
+  pipe_streambuf buf;
+  {
+    std::ostream os(&buf);
+    writer_options woptions;
+    woptions.block_slack = block_slack;
+    make_project(shape, data3d)->write(os, woptions);
+  }
+
+  // Keep the blocks
+  const auto pis = std::make_shared<std::istream>(&buf);
+  reader_options options;
+  options.sequential = true;
+  const std::shared_ptr<asdf> project =
+      std::make_shared<asdf>(pis, std::string(), map<string, asdf::reader_t>(),
+                             options);
+  const std::shared_ptr<group> grp = project->get_group();
+  std::map<int64_t, std::string> names;
+  for (const auto &[k, v] : *grp->get_group()) {
+    const std::shared_ptr<ndarray> arr = v->get_maybe_ndarray();
+    if (!arr)
+      continue;
+    if (!data_equal(shape, data3d, arr->get_data_vector<T>())) {
+      std::cerr << "Dataset \"" << k << "\" is incorrect\n";
+      std::exit(1);
+    }
+    names[arr->get_source()] = k;
+  }
+
+  // Hand the blocks to a callback
+  pipe_streambuf buf2(buf.get_data());
+  const auto pis2 = std::make_shared<std::istream>(&buf2);
+  size_t nblocks = 0;
+  options.block_callback = [&](int64_t source,
+                               const std::shared_ptr<block_t> &data) {
+    const T *const ptr = static_cast<const T *>(data->ptr());
+    if (data->nbytes() != data3d.size() * sizeof(T) ||
+        !data_equal(shape, data3d, std::vector<T>(ptr, ptr + data3d.size()))) {
+      std::cerr << "Block " << source << " (\"" << names.at(source)
+                << "\") is incorrect\n";
+      std::exit(1);
+    }
+    ++nblocks;
+  };
+  asdf(pis2, std::string(), map<string, asdf::reader_t>(), options);
+  if (nblocks != names.size()) {
+    std::cerr << "Not all blocks were handed to the callback\n";
+    std::exit(1);
+  }
+}
+
 int main(int argc, char **argv) {
   cout << "asdf-demo: Create a compressed ASDF file\n";
   ASDF_CHECK_VERSION();
@@ -167,8 +429,25 @@ int main(int argc, char **argv) {
   const std::vector<int64_t> shape{101, 101, 101};
   const auto data = make_data<float64_t>(shape);
 
-  write_file(shape, data);
-  read_file(shape, data);
+  write_file(shape, data, "compression.asdf");
+  read_file(shape, data, "compression.asdf");
+  read_file(shape, data, "compression.asdf", false, true);
+  read_file_batch(shape, data);
+  read_file_chunks(shape, data);
+  read_memory(shape, data);
+
+  // Streaming and direct I/O do not depend on the array size; keep these
+  // writes short
+  const std::vector<int64_t> small_shape{31, 31, 31};
+  const auto small_data = make_data<float64_t>(small_shape);
+  write_read_pipe(small_shape, small_data);
+  write_read_pipe(small_shape, small_data, 0.5);
+
+  // Bypass the page cache
+  writer_options options;
+  options.direct_io = true;
+  write_file(small_shape, small_data, "compression-direct.asdf", options);
+  read_file(small_shape, small_data, "compression-direct.asdf", true);
 
   std::cout << "Done.\n";
   return 0;
@@ -15,35 +15,31 @@ int main(int argc, char **argv) {
   ASDF_CHECK_VERSION();
 
   const int64_t ni = 1000, nj = 1000, nk = 250;
-  const auto getidx = [&](int64_t i, int64_t j, int64_t k) {
-    return (i * nj + j) * nk + k;
-  };
-  const int64_t npoints = ni * nj * nk;
-
-  cout << "  allocating..." << flush;
-  vector<float64_t> rho(npoints);
-  cout << "\n";
 
-  cout << "  initializing..." << flush;
-  for (int64_t i = 0; i < ni; ++i) {
-    for (int64_t j = 0; j < nj; ++j) {
-      for (int64_t k = 0; k < nk; ++k) {
-        int64_t idx = getidx(i, j, k);
-        rho.at(idx) = 1.0 / (1.1 * i + 1.2 * j + 1.3 * k + 1);
+  // Generate the data while writing, one row (i.e. a fixed value of i) at a
+  // time, so that the array never needs to be held in memory as a whole
+  cout << "  creating project..." << flush;
+  const row_generator_t generator = [=](int64_t begin, int64_t count,
+                                        void *buf) {
+    float64_t *const rho = static_cast<float64_t *>(buf);
+    for (int64_t i = begin; i < begin + count; ++i) {
+      for (int64_t j = 0; j < nj; ++j) {
+        for (int64_t k = 0; k < nk; ++k) {
+          const int64_t idx = ((i - begin) * nj + j) * nk + k;
+          rho[idx] = 1.0 / (1.1 * i + 1.2 * j + 1.3 * k + 1);
+        }
       }
     }
-  }
-  cout << "\n";
-
-  cout << "  creating project..." << flush;
+  };
   const auto
       compression = // have_compression_blosc2()  ? compression_t::blosc2 :
       have_compression_blosc() ? compression_t::blosc : compression_t::zlib;
   const int level = 9;
-  auto array3d = make_shared<ndarray>(std::move(rho), block_format_t::block,
-                                      compression, level, std::vector<bool>(),
-                                      std::vector<int64_t>{ni, nj, nk});
-  assert(rho.empty());
+  const int64_t rows_per_chunk = 10;
+  auto array3d = make_shared<ndarray>(
+      generator, rows_per_chunk, block_format_t::block, compression, level,
+      make_shared<datatype_t>(id_float64), host_byteorder(),
+      std::vector<int64_t>{ni, nj, nk});
   auto grp = make_shared<group>();
   grp->emplace("rho", array3d);
   auto project = make_shared<asdf>(map<string, string>(), grp);
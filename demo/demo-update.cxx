@@ -0,0 +1,344 @@
+#include <asdf/asdf.hxx>
+
+#include <yaml-cpp/yaml.h>
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace ASDF;
+
+void append_streamed() {
+  std::cout << "appending to a streamed block...\n";
+
+  // Start with two rows
+  const std::vector<int64_t> shape{2, 3};
+  std::vector<int64_t> data{0, 1, 2, 3, 4, 5};
+  auto grp = make_shared<group>();
+  grp->emplace("constant", make_shared<ndarray>(std::vector<int64_t>{42},
+                                                block_format_t::block,
+                                                compression_t::zlib, 9,
+                                                std::vector<bool>(),
+                                                std::vector<int64_t>{1}));
+  auto series = make_shared<ndarray>(data, block_format_t::block,
+                                     compression_t::none, 0,
+                                     std::vector<bool>(), shape);
+  series->set_streamed(true);
+  grp->emplace("series", series);
+  asdf(map<string, string>(), grp).write("streamed.asdf");
+
+  // Append three rows and a partial row
+  {
+    streamed_block_appender_t appender("streamed.asdf");
+    for (int64_t row = 2; row < 5; ++row) {
+      const std::vector<int64_t> newdata{3 * row, 3 * row + 1, 3 * row + 2};
+      appender.append(newdata.data(), newdata.size() * sizeof(int64_t));
+      data.insert(data.end(), newdata.begin(), newdata.end());
+    }
+    const int64_t partial = -1;
+    appender.append(&partial, sizeof partial);
+  }
+
+  for (const bool sequential : {false, true}) {
+    reader_options options;
+    options.sequential = sequential;
+    const auto pis = std::make_shared<std::ifstream>("streamed.asdf",
+                                                     ios::binary | ios::in);
+    const asdf project(pis, "streamed.asdf", map<string, asdf::reader_t>(),
+                       options);
+    const auto arr = project.get_group()->at("series")->get_maybe_ndarray();
+    const auto constant =
+        project.get_group()->at("constant")->get_maybe_ndarray();
+    if (!arr->get_streamed() ||
+        arr->get_shape() != std::vector<int64_t>{5, 3} ||
+        arr->get_data_vector<int64_t>() != data ||
+        constant->get_data_vector<int64_t>() != std::vector<int64_t>{42}) {
+      std::cerr << "Streamed dataset is incorrect\n";
+      std::exit(1);
+    }
+  }
+}
+
+// The file positions of the blocks, as listed in the block index
+std::vector<int64_t> block_positions(const std::string &filename) {
+  std::ifstream is(filename, ios::binary | ios::in);
+  const std::string contents((std::istreambuf_iterator<char>(is)),
+                             std::istreambuf_iterator<char>());
+  const std::string index_header = "#ASDF BLOCK INDEX\n%YAML 1.1\n";
+  const size_t index_pos = contents.rfind(index_header);
+  assert(index_pos != std::string::npos);
+  return YAML::Load(contents.substr(index_pos + index_header.size()))
+      .as<std::vector<int64_t>>();
+}
+
+void append_arrays() {
+  std::cout << "appending arrays to a file...\n";
+
+  const auto make_array = [](int64_t value, int64_t n,
+                             compression_t compression) {
+    return make_shared<ndarray>(std::vector<int64_t>(n, value),
+                                block_format_t::block, compression, 9,
+                                std::vector<bool>(), std::vector<int64_t>{n});
+  };
+  const auto check = [](const std::map<std::string, int64_t> &want) {
+    const asdf project("append.asdf");
+    const auto grp = project.get_group();
+    for (const auto &[key, value] : want) {
+      const auto arr = grp->at(key)->get_maybe_ndarray();
+      const std::vector<int64_t> data = arr->get_data_vector<int64_t>();
+      if (data.empty() || data != std::vector<int64_t>(data.size(), value)) {
+        std::cerr << "Appended dataset \"" << key << "\" is incorrect\n";
+        std::exit(1);
+      }
+    }
+  };
+
+  {
+    auto grp = make_shared<group>();
+    grp->emplace("a", make_array(1, 1000, compression_t::zlib));
+    grp->emplace("b", make_array(2, 100000, compression_t::none));
+    asdf(map<string, string>(), grp).write("append.asdf");
+  }
+  check({{"a", 1}, {"b", 2}});
+
+  // The tree grows; the first block needs to move
+  {
+    asdf project("append.asdf");
+    project.get_group()->emplace("c", make_array(3, 1000, compression_t::none));
+    project.append("append.asdf");
+  }
+  check({{"a", 1}, {"b", 2}, {"c", 3}});
+
+  // The tree shrinks and is rewritten in place
+  {
+    asdf project("append.asdf");
+    project.get_group()->get_group()->erase("c");
+    project.get_group()->emplace("d", make_array(4, 10, compression_t::zlib));
+    project.append("append.asdf");
+  }
+  check({{"a", 1}, {"b", 2}, {"d", 4}});
+
+  // Blocks are kept in place when the file is named differently
+  {
+    const std::vector<int64_t> before = block_positions("append.asdf");
+    asdf project("append.asdf");
+    project.append(std::filesystem::absolute("append.asdf").string());
+    if (block_positions("append.asdf") != before) {
+      std::cerr << "Appending via an absolute path copied the blocks\n";
+      std::exit(1);
+    }
+  }
+  check({{"a", 1}, {"b", 2}, {"d", 4}});
+
+  // The tree grows by more than one block; several blocks need to move, and
+  // their indices gain digits
+  {
+    auto grp = make_shared<group>();
+    for (int n = 10; n < 30; ++n)
+      grp->emplace("e" + std::to_string(n),
+                   make_array(n, 10, compression_t::zlib));
+    asdf(map<string, string>(), grp).write("append.asdf");
+  }
+  const int64_t first_block = block_positions("append.asdf").at(0);
+  {
+    asdf project("append.asdf");
+    for (int n = 0; n < 10; ++n)
+      project.get_group()->insert("note" + std::to_string(n),
+                                  make_entry(std::string(40, 'x')));
+    project.append("append.asdf");
+  }
+  const std::vector<int64_t> positions = block_positions("append.asdf");
+  if (positions.size() != 20 || positions.at(0) <= first_block + 200) {
+    std::cerr << "Appending did not move several blocks\n";
+    std::exit(1);
+  }
+  std::map<std::string, int64_t> want;
+  for (int n = 10; n < 30; ++n)
+    want["e" + std::to_string(n)] = n;
+  check(want);
+
+  // Packing gives the new arrays other sources and offsets than writing
+  // them one block each. Try tree paddings around the space the new tree
+  // needs, so that the new tree only just fits.
+  for (int64_t padding = 0; padding <= 2048; padding += 8) {
+    {
+      auto grp = make_shared<group>();
+      grp->emplace("a", make_array(1, 1000, compression_t::none));
+      writer_options options;
+      options.tree_padding = padding;
+      asdf(map<string, string>(), grp).write("append.asdf", options);
+    }
+    {
+      asdf project("append.asdf");
+      for (int n = 10; n < 20; ++n)
+        project.get_group()->emplace("p" + std::to_string(n),
+                                     make_array(n, 100, compression_t::zlib));
+      writer_options options;
+      options.pack_threshold = 1024;
+      project.append("append.asdf", options);
+    }
+    if (block_positions("append.asdf").size() != 2) {
+      std::cerr << "Appended arrays were not packed\n";
+      std::exit(1);
+    }
+    std::map<std::string, int64_t> want{{"a", 1}};
+    for (int n = 10; n < 20; ++n)
+      want["p" + std::to_string(n)] = n;
+    check(want);
+  }
+}
+
+void update_metadata() {
+  std::cout << "updating metadata in place...\n";
+
+  const std::vector<int64_t> data(1000, 5);
+  {
+    auto grp = make_shared<group>();
+    grp->emplace("data", make_shared<ndarray>(data, block_format_t::block,
+                                              compression_t::none, 0,
+                                              std::vector<bool>(),
+                                              std::vector<int64_t>{1000}));
+    grp->insert("comment", make_entry(std::string("first version")));
+    writer_options options;
+    options.tree_padding = 4096;
+    asdf(map<string, string>(), grp).write("metadata-update.asdf", options);
+  }
+  std::ifstream is("metadata-update.asdf", ios::binary | ios::in);
+  const std::string before((std::istreambuf_iterator<char>(is)),
+                           std::istreambuf_iterator<char>());
+
+  // This fits into the padding
+  {
+    const asdf project("metadata-update.asdf");
+    project.get_group()->get_group()->erase("comment");
+    project.get_group()->insert("comment",
+                                make_entry(std::string("second version")));
+    if (!project.update_tree("metadata-update.asdf")) {
+      std::cerr << "Tree was not updated in place\n";
+      std::exit(1);
+    }
+  }
+  {
+    const asdf project("metadata-update.asdf");
+    const auto grp = project.get_group();
+    if (grp->at("comment")->get_maybe_string() != "second version" ||
+        grp->at("data")->get_maybe_ndarray()->get_data_vector<int64_t>() !=
+            data) {
+      std::cerr << "Updated metadata are incorrect\n";
+      std::exit(1);
+    }
+  }
+  std::ifstream is2("metadata-update.asdf", ios::binary | ios::in);
+  const std::string after((std::istreambuf_iterator<char>(is2)),
+                          std::istreambuf_iterator<char>());
+  if (after.size() != before.size()) {
+    std::cerr << "The file size changed\n";
+    std::exit(1);
+  }
+
+  // This does not fit
+  {
+    const asdf project("metadata-update.asdf");
+    project.get_group()->insert("history",
+                                make_entry(std::string(10000, 'x')));
+    if (project.update_tree("metadata-update.asdf")) {
+      std::cerr << "Tree should not fit\n";
+      std::exit(1);
+    }
+  }
+}
+
+void overwrite_blocks() {
+  std::cout << "overwriting blocks in place...\n";
+
+  std::vector<int64_t> adata(1000, 5);
+  std::vector<int64_t> bdata(1000);
+  for (int64_t i = 0; i < 1000; ++i)
+    bdata[i] = i;
+  {
+    auto grp = make_shared<group>();
+    grp->emplace("a", make_shared<ndarray>(adata, block_format_t::block,
+                                           compression_t::zlib, 9,
+                                           std::vector<bool>(),
+                                           std::vector<int64_t>{1000}));
+    grp->emplace("b", make_shared<ndarray>(bdata, block_format_t::block,
+                                           compression_t::none, 0,
+                                           std::vector<bool>(),
+                                           std::vector<int64_t>{1000}));
+    writer_options options;
+    options.block_slack = 4;
+    asdf(map<string, string>(), grp).write("overwrite.asdf", options);
+  }
+  const auto read_file = [](const string &filename) {
+    std::ifstream is(filename, ios::binary | ios::in);
+    return std::string((std::istreambuf_iterator<char>(is)),
+                       std::istreambuf_iterator<char>());
+  };
+  const std::string before = read_file("overwrite.asdf");
+
+  // This compresses less well, but fits into the slack
+  for (int64_t i = 0; i < 1000; ++i)
+    adata[i] = i % 4;
+  {
+    const ndarray arr(adata, block_format_t::block, compression_t::zlib, 9,
+                      std::vector<bool>(), std::vector<int64_t>{1000});
+    if (!arr.overwrite_block("overwrite.asdf", 0)) {
+      std::cerr << "Block was not overwritten in place\n";
+      std::exit(1);
+    }
+  }
+  {
+    const asdf project("overwrite.asdf");
+    const auto grp = project.get_group();
+    if (grp->at("a")->get_maybe_ndarray()->get_data_vector<int64_t>() !=
+            adata ||
+        grp->at("b")->get_maybe_ndarray()->get_data_vector<int64_t>() !=
+            bdata) {
+      std::cerr << "Overwritten block is incorrect\n";
+      std::exit(1);
+    }
+  }
+  const std::string after = read_file("overwrite.asdf");
+  if (after.size() != before.size()) {
+    std::cerr << "The file size changed\n";
+    std::exit(1);
+  }
+
+  // This does not fit (checked against a file that is already open)
+  for (int64_t i = 0; i < 1000; ++i)
+    adata[i] = i * i;
+  {
+    const ndarray arr(adata, block_format_t::block, compression_t::zlib, 9,
+                      std::vector<bool>(), std::vector<int64_t>{1000});
+    const auto rs = reader_state::open("overwrite.asdf");
+    if (arr.overwrite_block(*rs, 0)) {
+      std::cerr << "Block should not fit\n";
+      std::exit(1);
+    }
+  }
+  if (read_file("overwrite.asdf") != after) {
+    std::cerr << "The file was changed\n";
+    std::exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  cout << "asdf-demo-update: Update ASDF files in place\n";
+  ASDF_CHECK_VERSION();
+
+  append_streamed();
+  append_arrays();
+  update_metadata();
+  overwrite_blocks();
+
+  std::cout << "Done.\n";
+  return 0;
+}
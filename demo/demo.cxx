@@ -3,20 +3,149 @@
 #include <yaml-cpp/yaml.h>
 
 #include <complex>
+#include <cstdlib>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <optional>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 using namespace std;
 using namespace ASDF;
 
+// Check that scalars are classified as yaml-cpp would convert them
+template <typename T>
+void check_scalar(const string &str, const optional<T> &value) {
+  optional<T> want;
+  try {
+    want = YAML::Node(str).as<T>();
+  } catch (const YAML::BadConversion &) {
+  }
+  const bool same =
+      bool(value) == bool(want) &&
+      (!value || *value == *want || (*value != *value && *want != *want));
+  if (!same) {
+    cerr << "Scalar \"" << str << "\" is converted incorrectly\n";
+    exit(1);
+  }
+}
+
+void check_scalars() {
+  for (const string str :
+       {"", "y", "Y", "n", "yes", "Yes", "YES", "yES", "YeS", "no", "true",
+        "True", "TRUE", "tRUE", "false", "on", "ON", "off", "Off", "0", "-0",
+        "+0", "1", "+1", "-1", "017", "08", "-017", "0x1f", "0X1F", "-0x1f",
+        "0x", "0x-1", "++1", "+-1", " 1", "1 ", "1\t", "1 x", "1_000",
+        "9223372036854775807", "9223372036854775808", "-9223372036854775808",
+        "-9223372036854775809", "0x7fffffffffffffff", "1.5", "-1.5", "+1.5",
+        ".5", "5.", ".", "-.", "1e3", "1E-3", "1e+3", "1e", "1e+", "1.5e3.2",
+        ".e1", "1e400", "-1e400", "1e-400", "inf", "nan", ".inf", ".Inf",
+        "+.INF", "-.inf", "-.Inf", ".nan", ".NaN", ".NAN", ".nAn", " .inf",
+        "hello", "1.2.3"}) {
+    check_scalar(str, parse_yaml_bool(str));
+    check_scalar(str, parse_yaml_int(str));
+    check_scalar(str, parse_yaml_float(str));
+  }
+}
+
+// Check that the datatype of inline arrays without a datatype is inferred
+void check_inline_arrays() {
+  const auto read_array = [](const string &data) {
+    const YAML::Node node =
+        YAML::Load("!<tag:stsci.edu:asdf/core/ndarray-1.0.0> {data: " + data +
+                   "}");
+    return make_shared<ndarray>(nullptr, node);
+  };
+  const auto ints = read_array("[[1, -2], [0x10, 017]]");
+  const auto floats = read_array("[[1, -2.5, 1e3], [017, 0, 5.]]");
+  const auto complexes = read_array(
+      "[!<tag:stsci.edu:asdf/core/complex-1.0.0> 1+2j, "
+      "!<tag:stsci.edu:asdf/core/complex-1.0.0> -3.5]");
+  // The values parsed before a wider one are converted
+  const auto mixed = read_array(
+      "[4, 2.5, !<tag:stsci.edu:asdf/core/complex-1.0.0> 3+1j]");
+  if (ints->get_datatype()->scalar_type_id != id_int64 ||
+      ints->get_data_vector<int64_t>() != vector<int64_t>{1, -2, 16, 15} ||
+      floats->get_datatype()->scalar_type_id != id_float64 ||
+      floats->get_data_vector<float64_t>() !=
+          vector<float64_t>{1, -2.5, 1000, 17, 0, 5} ||
+      floats->get_shape() != vector<int64_t>{2, 3} ||
+      complexes->get_datatype()->scalar_type_id != id_complex128 ||
+      complexes->get_data_vector<complex128_t>() !=
+          vector<complex128_t>{{1, 2}, {-3.5, 0}} ||
+      mixed->get_datatype()->scalar_type_id != id_complex128 ||
+      mixed->get_data_vector<complex128_t>() !=
+          vector<complex128_t>{{4, 0}, {2.5, 0}, {3, 1}}) {
+    cerr << "Inline array datatype is inferred incorrectly\n";
+    exit(1);
+  }
+}
+
+// Check that entries of groups and sequences read from a file are created
+// on demand, and consistently with creating them all at once
+void check_lazy_entries() {
+  const YAML::Node node = YAML::Load("{a: 1, b: [p, q, r], c: {d: 2}}");
+  const auto int_at = [](const group &grp, const string &key) {
+    return grp.at(key)->get_maybe_int();
+  };
+
+  // Counting and looking up a single entry
+  const group grp(nullptr, node);
+  if (grp.count("a") != 1 || grp.count("c") != 1 || grp.count("e") != 0 ||
+      int_at(grp, "a") != 1) {
+    cerr << "Lazy group entries are incorrect\n";
+    exit(1);
+  }
+  bool found_missing = true;
+  try {
+    grp.at("e");
+  } catch (const out_of_range &) {
+    found_missing = false;
+  }
+  if (found_missing) {
+    cerr << "Lazy group found a missing key\n";
+    exit(1);
+  }
+
+  // Entries created on demand are kept when all entries are created
+  const shared_ptr<entry> a = grp.at("a");
+  const auto entries = grp.get_group();
+  if (entries->size() != 3 || entries->at("a") != a ||
+      entries->at("c")->get_maybe_group()->at("d")->get_maybe_int() != 2) {
+    cerr << "Materialized lazy group is incorrect\n";
+    exit(1);
+  }
+
+  const sequence seq(nullptr, node["b"]);
+  const shared_ptr<entry> q = seq.at(1);
+  const auto elements = seq.get_sequence();
+  if (q->get_maybe_string() != "q" || elements->size() != 3 ||
+      elements->at(1) != q || elements->at(2)->get_maybe_string() != "r") {
+    cerr << "Lazy sequence entries are incorrect\n";
+    exit(1);
+  }
+
+  // Of duplicate keys, lookups and materialization agree on the first one
+  const YAML::Node dup_node = YAML::Load("{k: 1, k: 2}");
+  const group dup1(nullptr, dup_node), dup2(nullptr, dup_node);
+  if (int_at(dup1, "k") != 1 || dup2.get_group()->size() != 1 ||
+      dup2.get_group()->at("k")->get_maybe_int() != 1) {
+    cerr << "Lazy group with duplicate keys is inconsistent\n";
+    exit(1);
+  }
+}
+
 int main(int argc, char **argv) {
   cout << "asdf-demo: Create a simple ASDF file\n";
   ASDF_CHECK_VERSION();
 
+  check_scalars();
+  check_inline_arrays();
+  check_lazy_entries();
+
   auto grp = make_shared<group>();
 
   auto array1d = make_shared<ndarray>(
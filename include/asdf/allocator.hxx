@@ -0,0 +1,79 @@
+#ifndef ASDF_ALLOCATOR_HXX
+#define ASDF_ALLOCATOR_HXX
+
+#include <cstddef>
+#include <memory>
+
+namespace ASDF {
+using namespace std;
+
+// Memory allocation for block data
+
+// Decompressed block data is allocated through an allocator. Applications can
+// provide their own allocator, or choose one of the allocators below.
+class block_allocator_t {
+public:
+  virtual ~block_allocator_t() {}
+
+  virtual void *allocate(size_t nbytes) = 0;
+  virtual void deallocate(void *ptr, size_t nbytes) = 0;
+};
+
+// Allocate via `operator new`; this is the default
+class default_allocator_t : public block_allocator_t {
+public:
+  virtual ~default_allocator_t() {}
+
+  virtual void *allocate(size_t nbytes) override;
+  virtual void deallocate(void *ptr, size_t nbytes) override;
+};
+
+// Allocate with a particular alignment (e.g. 64 bytes for SIMD kernels)
+class aligned_allocator_t : public block_allocator_t {
+  size_t alignment;
+
+public:
+  aligned_allocator_t(size_t alignment = 64);
+
+  virtual ~aligned_allocator_t() {}
+
+  size_t get_alignment() const { return alignment; }
+
+  virtual void *allocate(size_t nbytes) override;
+  virtual void deallocate(void *ptr, size_t nbytes) override;
+};
+
+// Allocate large blocks in huge pages. Transparent huge pages are requested
+// via `madvise`; explicit huge pages are requested via `mmap` and need to be
+// set up by the system administrator. If explicit huge pages are not
+// available, transparent huge pages are used instead. Small blocks are
+// allocated with a 64-byte alignment.
+enum class huge_pages_t { transparent, explicit_pages };
+
+class huge_page_allocator_t : public block_allocator_t {
+  huge_pages_t huge_pages;
+  size_t min_nbytes;
+
+public:
+  huge_page_allocator_t(huge_pages_t huge_pages = huge_pages_t::transparent,
+                        size_t min_nbytes = huge_page_size);
+
+  virtual ~huge_page_allocator_t() {}
+
+  static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+  virtual void *allocate(size_t nbytes) override;
+  virtual void deallocate(void *ptr, size_t nbytes) override;
+};
+
+// The allocator that is used when no allocator is specified explicitly
+shared_ptr<block_allocator_t> get_default_block_allocator();
+void set_default_block_allocator(shared_ptr<block_allocator_t> allocator);
+
+} // namespace ASDF
+
+#define ASDF_ALLOCATOR_HXX_DONE
+#endif // #ifndef ASDF_ALLOCATOR_HXX
+#ifndef ASDF_ALLOCATOR_HXX_DONE
+#error "Cyclic include depencency"
+#endif
@@ -1,14 +1,17 @@
 #ifndef ASDF_ASDF_HXX
 #define ASDF_ASDF_HXX
 
+#include <asdf/allocator.hxx>
 #include <asdf/byteorder.hxx>
 #include <asdf/config.hxx>
 #include <asdf/datatype.hxx>
 #include <asdf/entry.hxx>
+#include <asdf/file.hxx>
 #include <asdf/io.hxx>
 #include <asdf/ndarray.hxx>
 #include <asdf/reference.hxx>
 #include <asdf/stl.hxx>
+#include <asdf/stream.hxx>
 #include <asdf/table.hxx>
 
 #include <yaml-cpp/yaml.h>
@@ -71,11 +74,42 @@ public:
 
   static YAML::Node from_yaml(istream &is);
   asdf(const shared_ptr<istream> &pis, const string &filename = {},
-       const map<string, reader_t> &readers = {});
-  asdf(const string &filename, const map<string, reader_t> &readers = {});
+       const map<string, reader_t> &readers = {},
+       const reader_options &options = {});
+  asdf(const string &filename, const map<string, reader_t> &readers = {},
+       const reader_options &options = {});
+  // Read from a buffer in memory without copying it. `owner` keeps the
+  // buffer alive for as long as the data are accessed; uncompressed arrays
+  // are views into the buffer.
+  asdf(const void *ptr, size_t nbytes, shared_ptr<const void> owner,
+       const map<string, reader_t> &readers = {},
+       const reader_options &options = {});
   asdf copy(const copy_state &cs) const;
-  void write(ostream &os) const;
-  void write(const string &filename) const;
+  void write(output_sink_t &sink, const writer_options &options = {}) const;
+  void write(ostream &os, const writer_options &options = {}) const;
+  void write(const string &filename, const writer_options &options = {}) const;
+  // Write into a preallocated memory region of at least `encoded_size()`
+  // bytes; return the number of bytes written
+  size_t write(void *ptr, size_t nbytes,
+               const writer_options &options = {}) const;
+  // Append to the existing file `filename`, from which (some of) the arrays
+  // were read. Blocks already in the file stay in place; only new blocks and
+  // a new block index are written after them. The tree is rewritten in place
+  // if it fits into the space before the first block; else the leading
+  // blocks that it would overwrite are moved to the end of the file, and
+  // `options.tree_padding` bytes are reserved again. Objects read from the
+  // file before should not be used to read data afterwards.
+  void append(const string &filename,
+              const writer_options &options = {}) const;
+  // Rewrite only the tree of the existing file `filename`, e.g. after
+  // changing metadata. This requires that all arrays were read from that
+  // file, and that the new tree fits into the space before the first block
+  // (see `writer_options::tree_padding`). Return false (and leave the file
+  // unchanged) otherwise.
+  bool update_tree(const string &filename) const;
+  // The size of the encoded file. This encodes the file without storing it;
+  // compressed blocks are thus compressed (and generated arrays generated).
+  size_t encoded_size(const writer_options &options = {}) const;
 
   shared_ptr<group> get_group() const { return grp; }
 };
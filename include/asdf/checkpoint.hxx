@@ -0,0 +1,155 @@
+#ifndef ASDF_CHECKPOINT_HXX
+#define ASDF_CHECKPOINT_HXX
+
+#include <asdf/asdf.hxx>
+#include <asdf/entry.hxx>
+#include <asdf/io.hxx>
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ASDF {
+using namespace std;
+
+// Writing checkpoints in the background
+
+// The progress of a checkpoint that is being written
+class checkpoint_status_t {
+  friend class checkpoint_writer_t;
+
+  string filename;
+  atomic<int64_t> nbytes_written;
+  mutable mutex mtx;
+  mutable condition_variable cv;
+  bool done;
+
+  void add_nbytes_written(int64_t nbytes) { nbytes_written += nbytes; }
+  void set_done();
+
+public:
+  checkpoint_status_t() = delete;
+  checkpoint_status_t(const checkpoint_status_t &) = delete;
+  checkpoint_status_t(checkpoint_status_t &&) = delete;
+  checkpoint_status_t &operator=(const checkpoint_status_t &) = delete;
+  checkpoint_status_t &operator=(checkpoint_status_t &&) = delete;
+
+  checkpoint_status_t(string filename)
+      : filename(std::move(filename)), nbytes_written(0), done(false) {}
+
+  const string &get_filename() const { return filename; }
+  // The number of bytes written so far
+  int64_t get_nbytes_written() const { return nbytes_written; }
+  // Whether the checkpoint has been written completely (and synced, if
+  // requested)
+  bool is_done() const;
+  // Wait until the checkpoint has been written
+  void wait() const;
+};
+
+// Write checkpoints on a background thread, so that the caller (e.g. a
+// simulation) can continue while the data are compressed, written, and
+// synced. Each checkpoint is a snapshot of the project taken when `write` is
+// called (see `copy_state::copy_data`); the caller can modify its arrays
+// right away. Checkpoints are written one after the other. Direct I/O is not
+// supported.
+class checkpoint_writer_t {
+  writer_options options;
+  int64_t max_pending;
+  function<void(const checkpoint_status_t &status)> on_done;
+
+  struct checkpoint_t {
+    asdf project;
+    shared_ptr<checkpoint_status_t> status;
+  };
+  mutable mutex mtx;
+  mutable condition_variable cv;
+  // The first checkpoint is the one being written
+  deque<checkpoint_t> pending;
+  bool stopping;
+  thread worker;
+
+  void run();
+
+public:
+  checkpoint_writer_t() = delete;
+  checkpoint_writer_t(const checkpoint_writer_t &) = delete;
+  checkpoint_writer_t(checkpoint_writer_t &&) = delete;
+  checkpoint_writer_t &operator=(const checkpoint_writer_t &) = delete;
+  checkpoint_writer_t &operator=(checkpoint_writer_t &&) = delete;
+
+  // At most `max_pending` checkpoints are in flight at a time; `write` waits
+  // for the oldest one to finish otherwise. `on_done` (if set) is called on
+  // the background thread after each checkpoint has been written.
+  checkpoint_writer_t(
+      const writer_options &options, int64_t max_pending = 1,
+      function<void(const checkpoint_status_t &status)> on_done = nullptr);
+
+  // Wait for all pending checkpoints
+  ~checkpoint_writer_t();
+
+  // Take a snapshot of `project` and write it to `filename` in the
+  // background. Return a handle that reports the checkpoint's progress.
+  shared_ptr<const checkpoint_status_t> write(const asdf &project,
+                                              const string &filename);
+
+  // The number of checkpoints that have not been written yet
+  int64_t get_pending_count() const;
+  // Wait until all pending checkpoints have been written
+  void wait() const;
+};
+
+// Write a series of checkpoints incrementally. Arrays whose contents have
+// not changed since they were last written are not stored again; they are
+// replaced by references into the earlier file that holds their data.
+// Arrays are identified by their path in the tree. References always point
+// to the file holding the data, never to another reference. The earlier
+// files need to be kept; `asdf-copy --resolve-references` turns a checkpoint
+// into a standalone file (see `copy_state::resolve_references`). All
+// checkpoints need to be in the same directory, unless their file names are
+// absolute.
+class incremental_writer_t {
+  // The contents of an array (data and metadata), and the file holding it
+  struct stored_array_t {
+    array<unsigned char, 16> hash;
+    string filename;
+  };
+  map<vector<string>, stored_array_t> stored;
+
+  void replace_unchanged(shared_ptr<entry> &ent, vector<string> &path,
+                         const string &filename,
+                         map<vector<string>, stored_array_t> &new_stored);
+
+public:
+  incremental_writer_t() = default;
+  incremental_writer_t(const incremental_writer_t &) = default;
+  incremental_writer_t(incremental_writer_t &&) = default;
+  incremental_writer_t &operator=(const incremental_writer_t &) = default;
+  incremental_writer_t &operator=(incremental_writer_t &&) = default;
+
+  // Return a copy of `project`, to be written to `filename`, in which
+  // unchanged arrays are replaced by references. The remaining arrays are
+  // recorded as being held by `filename`.
+  asdf prepare(const asdf &project, const string &filename);
+  void write(const asdf &project, const string &filename,
+             const writer_options &options = {}) {
+    prepare(project, filename).write(filename, options);
+  }
+};
+
+} // namespace ASDF
+
+#define ASDF_CHECKPOINT_HXX_DONE
+#endif // #ifndef ASDF_CHECKPOINT_HXX
+#ifndef ASDF_CHECKPOINT_HXX_DONE
+#error "Cyclic include depencency"
+#endif
@@ -7,6 +7,7 @@
 #include <yaml-cpp/yaml.h>
 
 #include <complex>
+#include <optional>
 #include <type_traits>
 #include <vector>
 
@@ -252,6 +253,13 @@ YAML::Node yaml_encode(complex32_t val);
 YAML::Node yaml_encode(complex64_t val);
 YAML::Node yaml_encode(complex128_t val);
 
+// Convert a YAML scalar the way `YAML::Node::as` does (accepting the same
+// forms, e.g. "Yes", "0x1f", or ".inf"), but in a single pass and without
+// throwing or allocating. Return nothing if the conversion fails.
+std::optional<bool> parse_yaml_bool(const string &str);
+std::optional<int64_t> parse_yaml_int(const string &str);
+std::optional<float64_t> parse_yaml_float(const string &str);
+
 void parse_scalar(const YAML::Node &node, unsigned char *data,
                   scalar_type_id_t scalar_type_id,
                   byteorder_t byteorder = host_byteorder());
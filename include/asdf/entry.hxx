@@ -15,6 +15,7 @@
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <tuple>
@@ -433,9 +434,8 @@ public:
     return entry_type_t::reference;
   }
 
-  virtual std::shared_ptr<entry> copy(const copy_state &cs) const override {
-    return std::make_shared<reference_entry>(cs, *this);
-  }
+  // See `copy_state::resolve_references`
+  virtual std::shared_ptr<entry> copy(const copy_state &cs) const override;
 
   virtual writer &to_yaml(writer &w) const override;
   friend writer &operator<<(writer &w, const reference_entry &ent) {
@@ -449,8 +449,24 @@ public:
   std::shared_ptr<reference> get_reference() const { return value; }
 };
 
+// The YAML node of a sequence or group read from a file. The entries are
+// created from it only when they are first accessed, and are kept
+// afterwards.
+struct pending_entries_t {
+  std::mutex mtx;
+  std::shared_ptr<reader_state> rs;
+  YAML::Node node;
+  // Whether all entries have been created
+  bool complete = false;
+};
+
 class sequence : public entry {
   std::shared_ptr<std::vector<std::shared_ptr<entry>>> entries;
+  // Set when read from a file; entries not yet created are null
+  std::shared_ptr<pending_entries_t> pending;
+
+  // Create all entries that have not been created yet
+  void materialize() const;
 
 public:
   using value_type = std::shared_ptr<std::vector<std::shared_ptr<entry>>>;
@@ -495,27 +511,33 @@ public:
 
   virtual std::shared_ptr<std::vector<std::shared_ptr<entry>>>
   get_maybe_sequence() const override {
-    return entries;
+    return get_sequence();
   }
 
   void push_back(std::shared_ptr<entry> value) {
+    materialize();
     entries->push_back(std::move(value));
   }
   template <typename T> void emplace_back(T &&value) {
-    entries->push_back(make_entry(std::forward<T>(value)));
+    push_back(make_entry(std::forward<T>(value)));
   }
 
   std::size_t size() const { return entries->size(); }
-  std::shared_ptr<entry> at(const std::size_t n) const {
-    return entries->at(n);
-  }
+  // This creates only the requested entry
+  std::shared_ptr<entry> at(const std::size_t n) const;
   std::shared_ptr<std::vector<std::shared_ptr<entry>>> get_sequence() const {
+    materialize();
     return entries;
   }
 };
 
 class group : public entry, public std::enable_shared_from_this<group> {
   std::shared_ptr<std::map<std::string, std::shared_ptr<entry>>> entries;
+  // Set when read from a file; entries not yet created are missing
+  std::shared_ptr<pending_entries_t> pending;
+
+  // Create all entries that have not been created yet
+  void materialize() const;
 
 public:
   using value_type =
@@ -561,26 +583,26 @@ public:
 
   virtual std::shared_ptr<std::map<std::string, std::shared_ptr<entry>>>
   get_maybe_group() const override {
-    return entries;
+    return get_group();
   }
 
   void insert(std::pair<const std::string, std::shared_ptr<entry>> key_value) {
+    materialize();
     entries->insert(std::move(key_value));
   }
   void insert(const std::string &key, std::shared_ptr<entry> value) {
+    materialize();
     entries->emplace(key, std::move(value));
   }
   template <typename T> void emplace(const std::string &key, T &&value) {
-    entries->emplace(key, make_entry(std::forward<T>(value)));
-  }
-  std::size_t count(const std::string &key) const {
-    return entries->count(key);
-  }
-  std::shared_ptr<entry> at(const std::string &key) const {
-    return entries->at(key);
+    insert(key, make_entry(std::forward<T>(value)));
   }
+  // These create only the requested entry
+  std::size_t count(const std::string &key) const;
+  std::shared_ptr<entry> at(const std::string &key) const;
   std::shared_ptr<std::map<std::string, std::shared_ptr<entry>>>
   get_group() const {
+    materialize();
     return entries;
   }
 };
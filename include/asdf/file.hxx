@@ -0,0 +1,367 @@
+#ifndef ASDF_FILE_HXX
+#define ASDF_FILE_HXX
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace ASDF {
+using namespace std;
+
+// Random-access input files
+
+struct read_request_t {
+  void *buf;
+  size_t nbytes;
+  int64_t offset;
+};
+
+// Blocks are read via positioned reads. Reading does not modify any shared
+// file position, so that different blocks can be read concurrently from
+// different threads.
+class random_access_file_t {
+public:
+  virtual ~random_access_file_t() {}
+
+  // Read `nbytes` bytes starting at `offset`
+  virtual void read(void *buf, size_t nbytes, int64_t offset) const = 0;
+  // Try to read `nbytes` bytes starting at `offset`; return the number of
+  // bytes read, which is less than `nbytes` only at the end of the file
+  virtual size_t read_some(void *buf, size_t nbytes, int64_t offset) const = 0;
+  // The current size of the file (which might grow while it is read)
+  virtual int64_t get_size() const = 0;
+
+  // Read several byte ranges. `done(i)` is called (on the calling thread) as
+  // soon as request `i` has completed; requests may complete in any order.
+  virtual void read_batch(const vector<read_request_t> &requests,
+                          const function<void(size_t)> &done) const;
+
+  // Hint that a byte range will be read soon
+  virtual void will_need(int64_t, size_t) const {}
+
+  // Return a pointer to a byte range if the file is held in memory, so that
+  // it can be accessed without copying; else return nullptr. The pointer
+  // remains valid as long as the file object exists.
+  virtual const void *map(int64_t, size_t) const { return nullptr; }
+};
+
+// Direct I/O transfers must be aligned to this many bytes (the logical block
+// size of the device; 4096 bytes is safe for all current devices)
+constexpr size_t direct_io_alignment = 4096;
+
+// A file accessed via a file descriptor, using `pread`.
+//
+// With `direct_io`, large reads bypass the page cache (via `O_DIRECT`). They
+// are then performed in aligned pieces through an aligned bounce buffer, so
+// that the destination buffer, offset, and size need not be aligned. If the
+// file system does not support direct I/O, reads fall back to the page cache,
+// but the pages are released again after reading.
+class fd_file_t : public random_access_file_t {
+  int fd;
+  int direct_fd; // -1 if direct I/O is not available or not requested
+  bool direct_io;
+  // The io_uring instance used by `read_batch`; it is set up on first use
+  // and kept until the file is closed. One batch uses it at a time.
+  struct io_uring_state_t;
+  mutable mutex ring_mtx;
+  mutable unique_ptr<io_uring_state_t> ring;
+
+  void read_direct(void *buf, size_t nbytes, int64_t offset) const;
+
+public:
+  fd_file_t() = delete;
+  fd_file_t(const fd_file_t &) = delete;
+  fd_file_t(fd_file_t &&) = delete;
+  fd_file_t &operator=(const fd_file_t &) = delete;
+  fd_file_t &operator=(fd_file_t &&) = delete;
+
+  fd_file_t(const string &filename, bool direct_io = false);
+
+  virtual ~fd_file_t();
+
+  // Reads at least this large use direct I/O
+  static constexpr size_t direct_io_min_nbytes = 1024 * 1024;
+
+  virtual void read(void *buf, size_t nbytes, int64_t offset) const override;
+  virtual size_t read_some(void *buf, size_t nbytes,
+                           int64_t offset) const override;
+  virtual int64_t get_size() const override;
+
+  // Use io_uring if available, else fall back to `pread` (also while
+  // another thread's batch is using the ring)
+  virtual void read_batch(const vector<read_request_t> &requests,
+                          const function<void(size_t)> &done) const override;
+
+  // Use `posix_fadvise`; ignored for direct I/O
+  virtual void will_need(int64_t offset, size_t nbytes) const override;
+};
+
+// An adapter for callers that only have an `istream`. Reads are serialized.
+class istream_file_t : public random_access_file_t {
+  shared_ptr<istream> pis;
+  mutable mutex mtx;
+
+public:
+  istream_file_t() = delete;
+  istream_file_t(const istream_file_t &) = delete;
+  istream_file_t(istream_file_t &&) = delete;
+  istream_file_t &operator=(const istream_file_t &) = delete;
+  istream_file_t &operator=(istream_file_t &&) = delete;
+
+  istream_file_t(shared_ptr<istream> pis);
+
+  virtual ~istream_file_t() {}
+
+  virtual void read(void *buf, size_t nbytes, int64_t offset) const override;
+  virtual size_t read_some(void *buf, size_t nbytes,
+                           int64_t offset) const override;
+  virtual int64_t get_size() const override;
+};
+
+// A file held in memory, e.g. a buffer received via a message bus or a
+// shared memory segment. The buffer is not copied; `owner` keeps it alive.
+class memory_file_t : public random_access_file_t {
+  const unsigned char *data;
+  size_t size;
+  shared_ptr<const void> owner;
+
+public:
+  memory_file_t() = delete;
+  memory_file_t(const memory_file_t &) = delete;
+  memory_file_t(memory_file_t &&) = delete;
+  memory_file_t &operator=(const memory_file_t &) = delete;
+  memory_file_t &operator=(memory_file_t &&) = delete;
+
+  memory_file_t(const void *ptr, size_t nbytes, shared_ptr<const void> owner);
+
+  virtual ~memory_file_t() {}
+
+  virtual void read(void *buf, size_t nbytes, int64_t offset) const override;
+  virtual size_t read_some(void *buf, size_t nbytes,
+                           int64_t offset) const override;
+  virtual int64_t get_size() const override;
+  virtual const void *map(int64_t offset, size_t nbytes) const override;
+};
+
+// An input stream buffer that reads from memory without copying
+class memory_streambuf_t : public streambuf {
+public:
+  memory_streambuf_t() = delete;
+  memory_streambuf_t(const memory_streambuf_t &) = delete;
+  memory_streambuf_t(memory_streambuf_t &&) = delete;
+  memory_streambuf_t &operator=(const memory_streambuf_t &) = delete;
+  memory_streambuf_t &operator=(memory_streambuf_t &&) = delete;
+
+  memory_streambuf_t(const void *ptr, size_t nbytes);
+
+  virtual ~memory_streambuf_t() {}
+
+protected:
+  virtual pos_type seekoff(off_type off, ios_base::seekdir dir,
+                           ios_base::openmode which) override;
+  virtual pos_type seekpos(pos_type pos, ios_base::openmode which) override;
+};
+
+// Open a file for random access, using `pread` where available
+shared_ptr<random_access_file_t>
+open_random_access_file(const string &filename, bool direct_io = false);
+
+// Whether both names refer to the same existing file, e.g. via a relative
+// and an absolute path
+bool same_file(const string &filename1, const string &filename2);
+
+// Output files
+
+// An output stream buffer that writes via direct I/O (`O_DIRECT`), bypassing
+// the page cache. Data are collected in an aligned buffer and written in
+// aligned pieces; the last piece is padded, and the file is truncated to its
+// actual size when the buffer is closed. Seeking (e.g. to update a block
+// header) is supported; partially overwritten pieces are read back first. If
+// the file system does not support direct I/O, the file is written normally.
+class direct_filebuf_t : public streambuf {
+  int fd;
+  bool is_direct;
+  size_t buffer_size;
+  char *buffer;
+  int64_t buffer_begin; // file position of the beginning of the buffer
+  int64_t file_size;    // size of the data written so far
+
+  void read_aligned(char *buf, int64_t offset) const;
+  void write_buffer(size_t nbytes);
+  pos_type seek_to(int64_t pos);
+
+public:
+  direct_filebuf_t() = delete;
+  direct_filebuf_t(const direct_filebuf_t &) = delete;
+  direct_filebuf_t(direct_filebuf_t &&) = delete;
+  direct_filebuf_t &operator=(const direct_filebuf_t &) = delete;
+  direct_filebuf_t &operator=(direct_filebuf_t &&) = delete;
+
+  direct_filebuf_t(const string &filename,
+                   size_t buffer_size = 16 * 1024 * 1024);
+
+  virtual ~direct_filebuf_t();
+
+  bool is_open() const { return fd >= 0; }
+  // Write all remaining data and close the file
+  void close();
+
+protected:
+  virtual int_type overflow(int_type ch) override;
+  virtual pos_type seekoff(off_type off, ios_base::seekdir dir,
+                           ios_base::openmode which) override;
+  virtual pos_type seekpos(pos_type pos, ios_base::openmode which) override;
+};
+
+// Output sinks
+
+struct write_buffer_t {
+  const void *buf;
+  size_t nbytes;
+};
+
+// A destination for the encoded file. The writer hands over lists of buffers
+// (the YAML tree, each block header, each block's data) which a sink can pass
+// on without concatenating them first.
+class output_sink_t {
+public:
+  virtual ~output_sink_t() {}
+
+  // Append several buffers, in order
+  virtual void writev(const vector<write_buffer_t> &buffers) = 0;
+  // Append one buffer
+  void write(const void *buf, size_t nbytes) { writev({{buf, nbytes}}); }
+  // The position of the next byte. This is tracked by the sink, so that
+  // pipes and sockets can be written as well.
+  virtual int64_t tell() const = 0;
+  // Whether `patch` is supported
+  virtual bool is_seekable() const { return true; }
+  // Overwrite bytes that have already been written
+  virtual void patch(const void *buf, size_t nbytes, int64_t offset) = 0;
+  // Make the bytes written so far durable, as far as the sink supports this
+  virtual void sync() {}
+};
+
+// Write to an output stream
+class ostream_sink_t : public output_sink_t {
+  ostream &os;
+  int64_t pos;
+  bool seekable;
+
+public:
+  ostream_sink_t() = delete;
+  ostream_sink_t(const ostream_sink_t &) = delete;
+  ostream_sink_t(ostream_sink_t &&) = delete;
+  ostream_sink_t &operator=(const ostream_sink_t &) = delete;
+  ostream_sink_t &operator=(ostream_sink_t &&) = delete;
+
+  ostream_sink_t(ostream &os);
+
+  virtual ~ostream_sink_t() {}
+
+  virtual void writev(const vector<write_buffer_t> &buffers) override;
+  virtual int64_t tell() const override { return pos; }
+  virtual bool is_seekable() const override { return seekable; }
+  virtual void patch(const void *buf, size_t nbytes, int64_t offset) override;
+  // Flush the stream (the data might not reach stable storage yet)
+  virtual void sync() override;
+};
+
+// Write to a file descriptor via `writev`, handing all buffers to the kernel
+// in a single system call where possible
+class fd_sink_t : public output_sink_t {
+  int fd;
+  bool owns_fd;
+  int64_t pos;
+  bool seekable;
+
+public:
+  fd_sink_t() = delete;
+  fd_sink_t(const fd_sink_t &) = delete;
+  fd_sink_t(fd_sink_t &&) = delete;
+  fd_sink_t &operator=(const fd_sink_t &) = delete;
+  fd_sink_t &operator=(fd_sink_t &&) = delete;
+
+  // Create (or truncate) a file
+  fd_sink_t(const string &filename);
+  // Overwrite an existing file, starting at position `pos`; the file is
+  // truncated there unless `truncate` is false. Earlier bytes can be patched.
+  fd_sink_t(const string &filename, int64_t pos, bool truncate = true);
+  // Write to an open file descriptor, starting at its current position. The
+  // file descriptor is not closed.
+  fd_sink_t(int fd);
+
+  virtual ~fd_sink_t();
+
+  bool is_open() const { return fd >= 0; }
+
+  virtual void writev(const vector<write_buffer_t> &buffers) override;
+  virtual int64_t tell() const override { return pos; }
+  virtual bool is_seekable() const override { return seekable; }
+  virtual void patch(const void *buf, size_t nbytes, int64_t offset) override;
+  // Flush the file to stable storage via `fsync`
+  virtual void sync() override;
+};
+
+// Write into a caller-provided memory region, e.g. a shared memory segment.
+// The region must be large enough (see `asdf::encoded_size`).
+class memory_sink_t : public output_sink_t {
+  unsigned char *data;
+  size_t capacity;
+  size_t size;
+
+public:
+  memory_sink_t() = delete;
+  memory_sink_t(const memory_sink_t &) = delete;
+  memory_sink_t(memory_sink_t &&) = delete;
+  memory_sink_t &operator=(const memory_sink_t &) = delete;
+  memory_sink_t &operator=(memory_sink_t &&) = delete;
+
+  memory_sink_t(void *ptr, size_t nbytes);
+
+  virtual ~memory_sink_t() {}
+
+  size_t get_size() const { return size; }
+
+  virtual void writev(const vector<write_buffer_t> &buffers) override;
+  virtual int64_t tell() const override { return size; }
+  virtual void patch(const void *buf, size_t nbytes, int64_t offset) override;
+};
+
+// Discard the data, only counting bytes
+class counting_sink_t : public output_sink_t {
+  size_t size;
+
+public:
+  counting_sink_t(const counting_sink_t &) = delete;
+  counting_sink_t(counting_sink_t &&) = delete;
+  counting_sink_t &operator=(const counting_sink_t &) = delete;
+  counting_sink_t &operator=(counting_sink_t &&) = delete;
+
+  counting_sink_t() : size(0) {}
+
+  virtual ~counting_sink_t() {}
+
+  size_t get_size() const { return size; }
+
+  virtual void writev(const vector<write_buffer_t> &buffers) override;
+  virtual int64_t tell() const override { return size; }
+  virtual void patch(const void *buf, size_t nbytes, int64_t offset) override;
+};
+
+// Create a file for writing, using `writev` where available
+unique_ptr<output_sink_t> open_output_sink(const string &filename);
+
+} // namespace ASDF
+
+#define ASDF_FILE_HXX_DONE
+#endif // #ifndef ASDF_FILE_HXX
+#ifndef ASDF_FILE_HXX_DONE
+#error "Cyclic include depencency"
+#endif
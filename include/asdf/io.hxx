@@ -1,16 +1,20 @@
 #ifndef ASDF_IO_HXX
 #define ASDF_IO_HXX
 
+#include <asdf/allocator.hxx>
+#include <asdf/file.hxx>
 #include <asdf/memoized.hxx>
 
 #include <yaml-cpp/yaml.h>
 
 #include <cassert>
 #include <complex>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -42,21 +46,109 @@ bool have_compression_liblz4();
 bool have_compression_libzstd();
 bool have_compression_zlib();
 
+bool have_io_uring();
+
 std::ostream &operator<<(std::ostream &os, block_format_t block_format);
 std::ostream &operator<<(std::ostream &os, compression_t compression);
 
 class block_t;
 struct block_info_t;
 
+struct reader_options {
+  // Allocator for block data; use the default block allocator if not set
+  shared_ptr<block_allocator_t> allocator;
+  // Read large blocks via direct I/O, bypassing the page cache
+  bool direct_io = false;
+  // Read the file in a single pass without seeking, e.g. from a pipe or a
+  // socket. All blocks are read and decoded while the file is opened.
+  bool sequential = false;
+  // Read only the tree when the file is opened. The blocks are discovered
+  // (by scanning the block headers) when they are first accessed, e.g. when
+  // an array's data or block info are requested, so that tools that only
+  // inspect the tree need a single small read per file. Not available in
+  // sequential mode.
+  bool tree_only = false;
+  // In sequential mode, hand each block's data to this function (with the
+  // block's index, see `ndarray::get_source`) instead of keeping them. The
+  // arrays' data are then not available later.
+  function<void(int64_t source, const shared_ptr<block_t> &data)>
+      block_callback;
+};
+
+// Options for loading several blocks at once
+struct load_options {
+  // Blocks whose data are at most this many bytes apart are read together
+  int64_t max_gap = 64 * 1024;
+  // Do not merge blocks into reads larger than this
+  int64_t max_extent_size = 64 * 1024 * 1024;
+  // Tell the operating system which parts of the file will be read
+  bool readahead = true;
+};
+
+struct writer_options {
+  // Write via direct I/O, bypassing the page cache
+  bool direct_io = false;
+  // Reserve this many bytes after the tree, so that the tree can later be
+  // updated in place (see `asdf::update_tree`)
+  int64_t tree_padding = 0;
+  // Over-allocate each block by this fraction of its (compressed) size, so
+  // that it can later be overwritten in place by data that compress less
+  // well (see `ndarray::overwrite_block`)
+  double block_slack = 0;
+  // Flush the written file to stable storage (see `output_sink_t::sync`)
+  bool sync = false;
+  // Write arrays with identical data only once, even if their data are not
+  // shared. This hashes the data of all arrays. (Arrays that share their
+  // data, e.g. copies, are always written only once.)
+  bool deduplicate_blocks = false;
+  // Pack arrays whose data have at most this many bytes into shared blocks,
+  // which are compressed as a whole. Each array refers to its part of the
+  // block via its offset. No arrays are packed if this is 0.
+  int64_t pack_threshold = 0;
+  // The maximum size of a shared block
+  int64_t pack_block_size = 1024 * 1024;
+};
+
 class reader_state {
   YAML::Node tree;
+  reader_options options;
   // TODO: Share "other_files" with other reader_state objects
   string filename;
   map<string, shared_ptr<reader_state>> other_files;
 
-  // TODO: Store only the file position
-  vector<memoized<block_t>> blocks;
-  vector<block_info_t> block_infos;
+  shared_ptr<random_access_file_t> file;
+
+  // The block table, with one entry per block in each column. Only what is
+  // needed to locate the blocks is kept. The complete block headers and the
+  // block data (as memoized state) are created on demand, so that the memory
+  // use scales with the number of blocks accessed, not the number of blocks
+  // in the file. The table is shared with the memoized block data, which may
+  // outlive the reader state.
+  struct block_table_t {
+    mutex mtx;
+    // The file position where the blocks begin, while the blocks have not
+    // been discovered yet (see `reader_options::tree_only`); else -1
+    int64_t scan_pos = -1;
+    vector<int64_t> positions; // file position of the block header
+    vector<uint16_t> header_sizes;
+    vector<uint32_t> flags;
+    vector<uint64_t> allocated_spaces;
+    map<int64_t, shared_ptr<const block_info_t>> infos;
+    map<int64_t, memoized<block_t>> data;
+
+    void add_block(const block_info_t &block_info);
+    // Scan the file for blocks if this has not been done yet. The mutex
+    // needs to be held.
+    void discover(const shared_ptr<random_access_file_t> &file);
+    // The mutex needs to be held
+    shared_ptr<const block_info_t>
+    get_info(const shared_ptr<random_access_file_t> &file, int64_t index);
+  };
+  shared_ptr<block_table_t> blocks;
+
+  // Return the block table after discovering the blocks if necessary
+  const block_table_t &get_blocks() const;
+  shared_ptr<const block_info_t> get_block_info_ptr(int64_t index) const;
 
 public:
   reader_state() = delete;
@@ -65,15 +157,62 @@ public:
   reader_state &operator=(const reader_state &) = delete;
   reader_state &operator=(reader_state &&) = default;
 
+  // Read blocks through the stream, beginning at its current position.
+  // `filename` is only used to resolve references to other files.
   reader_state(const YAML::Node &tree, const shared_ptr<istream> &pis,
-               const string &filename = {});
+               const string &filename = {},
+               const reader_options &options = {});
+  // Read blocks via random access, beginning at file position `pos`
+  reader_state(const YAML::Node &tree,
+               const shared_ptr<random_access_file_t> &file, int64_t pos,
+               const string &filename = {},
+               const reader_options &options = {});
+  // Read all blocks sequentially from the current position of a stream that
+  // cannot seek (see `reader_options::sequential`)
+  reader_state(const YAML::Node &tree, istream &is,
+               const reader_options &options);
 
-  memoized<block_t> get_block(int64_t index) const {
-    assert(index >= 0);
-    return blocks.at(index);
-  }
+  // Open a file, read its tree, and read the blocks via random access
+  // (e.g. via pread or direct I/O, see `open_random_access_file`)
+  static shared_ptr<reader_state> open(const string &filename,
+                                       const reader_options &options = {});
+
+  const YAML::Node &get_tree() const { return tree; }
+  const reader_options &get_options() const { return options; }
+  // Null in sequential mode
+  shared_ptr<random_access_file_t> get_file() const { return file; }
+
+  memoized<block_t> get_block(int64_t index) const;
 
+  // This re-reads the block header if necessary
   block_info_t get_block_info(int64_t index) const;
+  int64_t get_block_count() const { return get_blocks().positions.size(); }
+  // The file positions of block `index`: where its header begins, where its
+  // data begin, and where its slot ends
+  int64_t get_block_begin(int64_t index) const {
+    return get_blocks().positions.at(index);
+  }
+  int64_t get_block_data_begin(int64_t index) const {
+    const auto &blocks = get_blocks();
+    return blocks.positions.at(index) + 6 + blocks.header_sizes.at(index);
+  }
+  int64_t get_block_end(int64_t index) const {
+    return get_block_data_begin(index) +
+           get_blocks().allocated_spaces.at(index);
+  }
+  uint32_t get_block_flags(int64_t index) const {
+    return get_blocks().flags.at(index);
+  }
+  const string &get_filename() const { return filename; }
+
+  // Read the data of several blocks at once. Blocks are read in file order,
+  // nearby blocks are merged into larger reads, all reads are submitted
+  // together (via io_uring if available), and blocks are decompressed on
+  // worker threads as soon as their data arrive. Blocks that are already
+  // loaded are skipped.
+  void load_blocks(const vector<int64_t> &indices,
+                   const load_options &load_opts = {}) const;
+  void load_all_blocks(const load_options &load_opts = {}) const;
 
   YAML::Node resolve_reference(const vector<string> &path) const;
 
@@ -89,16 +228,79 @@ struct copy_state {
   compression_t compression;
   bool set_compression_level;
   int compression_level;
+  // Copy array data held in memory, so that the copy is a snapshot that is
+  // not affected if the data are modified later. Generated arrays are
+  // generated right away. Data that have not yet been read from a file are
+  // not copied, unless they are read from `overwritten_file`.
+  bool copy_data = false;
+  // With `copy_data`, the file that the copy is going to be written to.
+  // Data that would be read from this file are read and copied right away.
+  string overwritten_file = {};
+  // Replace references by copies of the entries they refer to, e.g. to turn
+  // a file referring to other files into a standalone file. This requires
+  // that the references were read from a file.
+  bool resolve_references = false;
+};
+
+// Blocks that are already present in the file being written, when appending
+// to a file
+struct existing_blocks_t {
+  string filename;
+  // The new index of each block, by old index
+  vector<int64_t> indices;
+  // The file position of each block, by new index
+  vector<int64_t> positions;
+};
+
+class ndarray;
+
+// Small arrays that are written into a shared block
+struct block_pack_t {
+  // The offset of each array's data in the block, and (a copy of) the array
+  vector<pair<int64_t, shared_ptr<const ndarray>>> arrays;
+  int64_t nbytes = 0;
 };
 
 class writer {
 
-  ostream &os;
+  unique_ptr<output_sink_t> own_sink; // set when writing to an `ostream`
+  output_sink_t &sink;
+  string preamble;
   YAML::Emitter emitter;
+  bool tree_done;
+  string tree;
+  int64_t tree_padding;
+  double block_slack;
+  bool deduplicate_blocks;
+  int64_t pack_threshold;
+  int64_t pack_block_size;
+
+  // The blocks added so far, with the offset of the data in the block and
+  // (a copy of) the array holding them, by a key describing their content
+  // (see `ndarray::to_yaml`). The copy keeps the array's data alive, so that
+  // their id is not reused while the writer exists.
+  struct block_key_t {
+    int64_t idx;
+    int64_t offset;
+    shared_ptr<const ndarray> arr;
+  };
+  multimap<string, block_key_t> block_keys;
+
+  // The shared blocks that are being filled, by a key describing their
+  // encoding
+  map<string, pair<int64_t, shared_ptr<block_pack_t>>> packs;
+
+  // When appending, the sink receives only the new blocks and the block
+  // index; the caller places the tree (see `get_tree`)
+  existing_blocks_t existing;
 
   // Tasks that write the blocks
   // TODO: rename this variable
-  vector<function<void(ostream &os)>> tasks;
+  vector<function<void(output_sink_t &sink)>> tasks;
+  // The task that writes the streamed block, if any
+  function<void(output_sink_t &sink)> streamed_task;
+
+  void begin(const map<string, string> &tags);
 
 public:
   writer(const writer &) = delete;
@@ -106,7 +308,14 @@ public:
   writer &operator=(const writer &) = delete;
   writer &operator=(writer &&) = delete;
 
-  writer(ostream &os, const map<string, string> &tags);
+  writer(output_sink_t &sink, const map<string, string> &tags,
+         const writer_options &options = {});
+  writer(ostream &os, const map<string, string> &tags,
+         const writer_options &options = {});
+  // Append to a file that already contains `existing` blocks. The sink must
+  // be positioned after the existing blocks.
+  writer(output_sink_t &sink, const map<string, string> &tags,
+         existing_blocks_t existing, const writer_options &options = {});
   ~writer();
 
   template <typename T> friend writer &operator<<(writer &w, const T &value) {
@@ -132,11 +341,75 @@ public:
   }
 
   // TODO: rename this function
-  int64_t add_task(function<void(ostream &)> &&task) {
+  int64_t add_task(function<void(output_sink_t &)> &&task) {
     tasks.push_back(std::move(task));
-    return tasks.size() - 1;
+    return existing.positions.size() + tasks.size() - 1;
   }
+  double get_block_slack() const { return block_slack; }
+  bool get_deduplicate_blocks() const { return deduplicate_blocks; }
+  // Find a block that was added under `key`, and for which `same` holds.
+  // Return its index (or -1) and the offset of the data in the block.
+  pair<int64_t, int64_t>
+  find_block(const string &key,
+             const function<bool(const ndarray &arr)> &same) const;
+  // Record that block `idx`, holding the data of `arr` at `offset`, was
+  // added under `key`
+  void add_block_key(const string &key, int64_t idx, int64_t offset,
+                     shared_ptr<const ndarray> arr) {
+    block_keys.insert({key, {idx, offset, std::move(arr)}});
+  }
+
+  int64_t get_pack_threshold() const { return pack_threshold; }
+  // Add `nbytes` bytes of data of `arr` to a shared block for arrays with
+  // the same `pack_key`. `make_task` creates the task writing a new shared
+  // block. Return the block index and the offset of the data in the block.
+  pair<int64_t, int64_t> add_to_pack(
+      const string &pack_key, int64_t nbytes, shared_ptr<const ndarray> arr,
+      const function<function<void(output_sink_t &sink)>(
+          const shared_ptr<const block_pack_t> &pack)> &make_task);
+  int64_t get_new_block_count() const {
+    return tasks.size() + bool(streamed_task);
+  }
+  // If block `source` read via `rs` is already present in the file being
+  // written, return its new index; else return -1
+  int64_t get_existing_block(const reader_state &rs, int64_t source) const;
+  // Add the task that writes the streamed block. This block is written last,
+  // and there is no block index. Return the block index (-1, i.e. the last
+  // block).
+  int64_t add_streamed_task(function<void(output_sink_t &)> &&task) {
+    // There can be at most one streamed block
+    assert(!streamed_task);
+    streamed_task = std::move(task);
+    return -1;
+  }
+
+  // Finish the tree and return it (including the file header)
+  const string &get_tree();
+  void flush();
+  // Abandon the file, e.g. to try a different layout
+  void discard();
+};
+
+// Append data to the streamed block at the end of an existing file, e.g. to
+// record an open-ended time series. The file remains open, so that data can
+// be appended continuously; neither the tree nor the block header are
+// rewritten. Readers infer the number of rows from the file size, so data
+// should be appended in whole rows.
+class streamed_block_appender_t {
+  ofstream os;
+
+public:
+  streamed_block_appender_t() = delete;
+  streamed_block_appender_t(const streamed_block_appender_t &) = delete;
+  streamed_block_appender_t(streamed_block_appender_t &&) = delete;
+  streamed_block_appender_t &
+  operator=(const streamed_block_appender_t &) = delete;
+  streamed_block_appender_t &operator=(streamed_block_appender_t &&) = delete;
+
+  streamed_block_appender_t(const string &filename);
 
+  void append(const void *buf, size_t nbytes);
+  // Make the data appended so far visible to readers
   void flush();
 };
 
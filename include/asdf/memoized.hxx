@@ -3,6 +3,7 @@
 
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <type_traits>
 #include <utility>
 
@@ -10,8 +11,10 @@ namespace ASDF {
 
 using namespace std;
 
+// Memoized states can be accessed concurrently from multiple threads
 template <typename T> class memoized_state {
   function<shared_ptr<T>()> fun;
+  mutable mutex mtx;
   bool have_value;
   shared_ptr<T> value;
 
@@ -20,22 +23,34 @@ public:
   memoized_state(function<shared_ptr<T>()> fun1)
       : fun(std::move(fun1)), have_value(false) {}
 
-  bool ready() const { return have_value; }
-  void make_ready() {
-    if (have_value)
-      return;
-    value = fun();
-    have_value = true;
+  bool ready() const {
+    lock_guard<mutex> lock(mtx);
+    return have_value;
   }
+  void make_ready() { get(); }
   void forget() {
+    lock_guard<mutex> lock(mtx);
     if (!have_value)
       return;
     value.reset();
     have_value = false;
   }
 
+  // Provide the value if it has not been calculated yet
+  void set(shared_ptr<T> value1) {
+    lock_guard<mutex> lock(mtx);
+    if (have_value)
+      return;
+    value = std::move(value1);
+    have_value = true;
+  }
+
   shared_ptr<T> get() {
-    make_ready();
+    lock_guard<mutex> lock(mtx);
+    if (!have_value) {
+      value = fun();
+      have_value = true;
+    }
     return value;
   }
 };
@@ -54,11 +69,14 @@ public:
       : state(make_shared<memoized_state<T>>(std::move(fun1))) {}
 
   bool valid() const { return bool(state); }
+  // Identifies the state, which is shared between copies
+  const void *get_id() const { return state.get(); }
   void reset() { state.reset(); }
 
   bool ready() const { return state->ready(); }
   void make_ready() const { state->make_ready(); }
   void forget() const { state->forget(); }
+  void set(shared_ptr<T> value) const { state->set(std::move(value)); }
 
   shared_ptr<T> get() const { return state->get(); }
 
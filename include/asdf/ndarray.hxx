@@ -1,15 +1,19 @@
 #ifndef ASDF_NDARRAY_HXX
 #define ASDF_NDARRAY_HXX
 
+#include <asdf/allocator.hxx>
 #include <asdf/datatype.hxx>
 #include <asdf/io.hxx>
 #include <asdf/memoized.hxx>
+#include <asdf/reference.hxx>
+#include <asdf/stream.hxx>
 
 #include <yaml-cpp/yaml.h>
 
 #include <array>
 #include <cassert>
 #include <cstddef>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <tuple>
@@ -96,6 +100,60 @@ public:
   virtual void resize(size_t nbytes) override { assert(0); }
 };
 
+// A read-only view of data owned by someone else, e.g. of a block in a file
+// held in memory. `owner` keeps the data alive. The data must not be
+// modified.
+class view_block_t : public block_t {
+  const void *data;
+  size_t size;
+  shared_ptr<const void> owner;
+
+public:
+  view_block_t() = delete;
+
+  view_block_t(const void *data, size_t size, shared_ptr<const void> owner)
+      : data(data), size(size), owner(std::move(owner)) {
+    assert(data || size == 0);
+  }
+
+  virtual ~view_block_t() {}
+
+  virtual const void *ptr() const override { return data; }
+  virtual void *ptr() override { return const_cast<void *>(data); }
+  virtual size_t nbytes() const override { return size; }
+  virtual void reserve(size_t nbytes) override { assert(0); }
+  virtual void resize(size_t nbytes) override { assert(0); }
+};
+
+// Block data allocated via a block allocator
+class allocated_block_t : public block_t {
+  shared_ptr<block_allocator_t> allocator;
+  void *data;
+  size_t size;
+  size_t capacity;
+
+public:
+  allocated_block_t() = delete;
+  allocated_block_t(const allocated_block_t &) = delete;
+  allocated_block_t(allocated_block_t &&) = delete;
+  allocated_block_t &operator=(const allocated_block_t &) = delete;
+  allocated_block_t &operator=(allocated_block_t &&) = delete;
+
+  allocated_block_t(shared_ptr<block_allocator_t> allocator, size_t nbytes);
+
+  virtual ~allocated_block_t();
+
+  virtual const void *ptr() const override { return data; }
+  virtual void *ptr() override { return data; }
+  virtual size_t nbytes() const override { return size; }
+  virtual void reserve(size_t nbytes) override;
+  virtual void resize(size_t nbytes) override;
+};
+
+// The block extends to the end of the file, which may still grow. Only the
+// last block can be streamed; it is not compressed and has no checksum.
+constexpr uint32_t block_flag_streamed = 0x1;
+
 // Information about a block
 // TODO: Rename block_t -> block_data_t, create new block_t as
 // tuple<memoized<block>, block_info>
@@ -106,15 +164,25 @@ struct block_info_t {
   uint32_t flags;
   array<unsigned char, 4> comp;
   compression_t compression;
-  uint64_t allocated_space;
-  uint64_t used_space;
+  uint64_t allocated_space; // size of the slot in the file
+  uint64_t used_space;      // size of the stored (compressed) data
   uint64_t data_space;
   array<unsigned char, 16> checksum;
+  int64_t data_begin; // file position of the block data
 };
 
 // ndarray
 
+class chunk_iterator_t;
+
+// Produce `count` rows of array data, starting at row `begin`, and store them
+// in `buf`
+typedef function<void(int64_t begin, int64_t count, void *buf)>
+    row_generator_t;
+
 class ndarray {
+  friend class chunk_iterator_t;
+
   memoized<block_t> mdata;
   std::optional<block_info_t> block_info; // TODO: remove duplicate information
 
@@ -128,11 +196,73 @@ class ndarray {
   int64_t offset;
   vector<int64_t> strides;
 
-  void write_block(ostream &os) const;
+  // Where the block data come from (only when read from a file)
+  shared_ptr<reader_state> rs;
+  int64_t source = -1;
+
+  // Where the block data come from (only when generated)
+  row_generator_t generator;
+  int64_t rows_per_chunk = 0;
+
+  // Write the data as a streamed block
+  bool streamed = false;
+
+  // Store the data as a delta relative to another array (see
+  // `set_delta_base`). When read from a file, only the reference is known.
+  shared_ptr<ndarray> delta_base;
+  shared_ptr<reference> delta_base_ref;
+
+  // Compress the data; return the compression token and the data as stored
+  std::tuple<array<unsigned char, 4>, shared_ptr<block_t>>
+  encode_block() const;
+  void write_block(output_sink_t &sink, double block_slack) const;
+  // A hash of the data (see `writer_options::deduplicate_blocks`). This
+  // loads the data.
+  size_t data_hash() const;
+  // The size of the (uncompressed) block data
+  int64_t get_block_nbytes() const;
+  // Write the data of several small arrays as one block (see
+  // `writer_options::pack_threshold`)
+  static void write_pack(output_sink_t &sink, const block_pack_t &pack,
+                         compression_t compression, int compression_level,
+                         double block_slack);
+  void write_block_streaming(output_sink_t &sink, double block_slack) const;
+  void write_block_streamed(output_sink_t &sink) const;
 
 public:
+  // Read the block header at file position `pos`, and advance `pos` to the
+  // next block. Return nothing if there is no block at `pos`.
+  static std::optional<block_info_t>
+  read_block_info(const shared_ptr<random_access_file_t> &file, int64_t &pos);
+  // The data of a block, read lazily
+  static memoized<block_t>
+  make_block_data(const shared_ptr<random_access_file_t> &file,
+                  const block_info_t &block_info,
+                  const shared_ptr<block_allocator_t> &allocator =
+                      get_default_block_allocator());
+  // Read the block header at file position `pos`, and advance `pos` to the
+  // next block. The block data are read lazily.
   static std::tuple<memoized<block_t>, block_info_t>
-  read_block(const shared_ptr<istream> &is);
+  read_block(const shared_ptr<random_access_file_t> &file, int64_t &pos,
+             const shared_ptr<block_allocator_t> &allocator =
+                 get_default_block_allocator());
+  // Read the next block from a stream that cannot seek, and advance `pos`
+  // (the stream position, counted by the caller) past it. The data are read
+  // and decoded right away. Return a null block if there are no more blocks.
+  static std::tuple<shared_ptr<block_t>, block_info_t>
+  read_block_sequential(istream &is, int64_t &pos,
+                        const shared_ptr<block_allocator_t> &allocator);
+
+  // Allocate a buffer that can hold the (possibly compressed) data of a block
+  // as stored in the file
+  static shared_ptr<block_t>
+  make_input_block(const block_info_t &block_info,
+                   const shared_ptr<block_allocator_t> &allocator);
+  // Verify the checksum and decompress the data read into an input block
+  static shared_ptr<block_t>
+  decode_block(const shared_ptr<block_t> &inblock,
+               const block_info_t &block_info,
+               const shared_ptr<block_allocator_t> &allocator);
 
   ndarray() = delete;
   ndarray(const ndarray &) = default;
@@ -192,6 +322,17 @@ public:
                 host_byteorder(), std::move(shape1), offset,
                 std::move(strides1)) {}
 
+  // An array whose data are produced by a generator, `rows_per_chunk` rows
+  // (i.e. index ranges in the first dimension) at a time, while the array is
+  // written. The data never need to be held in memory as a whole unless they
+  // are accessed via `get_data` or written with a compression that cannot be
+  // applied incrementally (blosc, blosc2). Writing compressed data requires a
+  // seekable output sink.
+  ndarray(row_generator_t generator, int64_t rows_per_chunk,
+          block_format_t block_format, compression_t compression,
+          int compression_level, shared_ptr<datatype_t> datatype,
+          byteorder_t byteorder, vector<int64_t> shape);
+
   ndarray(const shared_ptr<reader_state> &rs, const YAML::Node &node);
   ndarray(const copy_state &cs, const ndarray &arr);
   writer &to_yaml(writer &w) const;
@@ -212,8 +353,69 @@ public:
     return mdata;
   }
 
-  // Only available after reading a file, not available while writing
-  std::optional<block_info_t> get_block_info() const { return block_info; }
+  // Only available after reading a file, not available while writing. This
+  // may read the block header (see `reader_options::tree_only`).
+  std::optional<block_info_t> get_block_info() const {
+    if (!block_info && rs)
+      return rs->get_block_info(source);
+    return block_info;
+  }
+  // The index of the block holding the data, or -1
+  int64_t get_source() const { return source; }
+
+  // Write the array as a streamed block at the end of the file. Its first
+  // dimension is then stored as "*" and grows as rows are appended to the
+  // file (see `streamed_block_appender_t`); readers infer it from the file
+  // size. At most one array per file can be streamed. Streamed blocks are
+  // never compressed.
+  void set_streamed(bool streamed1) {
+    assert(block_format == block_format_t::block);
+    assert(!delta_base);
+    streamed = streamed1;
+  }
+  bool get_streamed() const { return streamed; }
+
+  // Store the array as the bitwise XOR of its data and the data of `base`,
+  // e.g. the same field at the previous time step. Slowly changing data
+  // then compress much better. `base_ref` tells readers where to find the
+  // base array, e.g. in the same or an earlier file; it must have the same
+  // datatype and shape. Both arrays need to be C-contiguous, and this array
+  // needs to begin at the start of its block. Readers reconstruct the data
+  // transparently; the delta is not part of the ASDF standard, though.
+  void set_delta_base(shared_ptr<ndarray> base, reference base_ref) {
+    assert(block_format == block_format_t::block);
+    assert(!streamed);
+    assert(base);
+    assert(base->datatype->type_size() == datatype->type_size());
+    assert(base->shape == shape);
+    assert(offset == 0 && is_contiguous());
+    assert(base->is_contiguous());
+    delta_base = std::move(base);
+    delta_base_ref = make_shared<reference>(std::move(base_ref));
+  }
+  // The reference to the delta base, if the array is stored as a delta
+  shared_ptr<reference> get_delta_base() const { return delta_base_ref; }
+
+  // Replace the data of block `source` of the existing file `filename` with
+  // this array's data, e.g. to update a checkpoint. This succeeds if the
+  // (re)compressed data fit into the block's allocated space (see
+  // `writer_options::block_slack`); the block then stays in place, and no
+  // other part of the file is touched. Return false (and leave the file
+  // unchanged) otherwise. The array's datatype and shape should match those
+  // in the file's tree, or the tree needs to be updated as well (see
+  // `asdf::update_tree`).
+  bool overwrite_block(const string &filename, int64_t source) const;
+  // The same for a file that is already open for reading via random access
+  bool overwrite_block(const reader_state &rs, int64_t source) const;
+
+  // Iterate over the array in chunks of `rows_per_chunk` rows, without
+  // holding the whole array in memory
+  chunk_iterator_t get_chunks(int64_t rows_per_chunk) const;
+
+  // Load the data of several arrays at once, reading their blocks in file
+  // order and merging nearby blocks (see `reader_state::load_blocks`)
+  static void load_data(const vector<shared_ptr<ndarray>> &arrays,
+                        const load_options &load_opts = {});
 
   template <typename T> vector<T> get_data_vector() const {
     assert(datatype->is_scalar);
@@ -221,9 +423,13 @@ public:
     int64_t npoints = 1;
     for (size_t d = 0; d < shape.size(); ++d)
       npoints *= shape.at(d);
-    const T *ptr = static_cast<const T *>(mdata->ptr());
+    const T *ptr = reinterpret_cast<const T *>(
+        static_cast<const unsigned char *>(mdata->ptr()) + offset);
     size_t nbytes = mdata->nbytes();
-    assert(nbytes == npoints * sizeof(T));
+    // Blocks may be shared with other arrays (see
+    // `writer_options::pack_threshold`), and streamed blocks may end with a
+    // partially appended row
+    assert(offset + npoints * sizeof(T) <= nbytes);
     vector<T> data(npoints);
     for (int64_t i = 0; i < npoints; ++i)
       data[i] = ptr[i];
@@ -231,9 +437,12 @@ public:
   }
 
   shared_ptr<datatype_t> get_datatype() const { return datatype; }
+  byteorder_t get_byteorder() const { return byteorder; }
   vector<int64_t> get_shape() const { return shape; }
   int64_t get_offset() const { return offset; }
   vector<int64_t> get_strides() const { return strides; }
+  // Whether the elements are stored in C order without gaps
+  bool is_contiguous() const;
 
   int64_t linear_index(const vector<int64_t> &idx) const {
     int rank = shape.size();
@@ -257,6 +466,50 @@ public:
   }
 };
 
+// Iterate over an array in chunks of consecutive rows, i.e. of index ranges
+// in the first (slowest-varying) dimension. Compressed blocks are
+// decompressed incrementally, and generated arrays are generated chunk by
+// chunk, so that memory use is bounded by the chunk size. Arrays whose data
+// are already in memory, or whose compression cannot be decompressed
+// incrementally (blosc, blosc2), are accessed directly. Only C-contiguous
+// arrays are supported. The chunk data have the array's byte order.
+class chunk_iterator_t {
+  // Where the data come from
+  shared_ptr<block_t> data;
+  unique_ptr<block_reader_t> reader;
+  row_generator_t generator;
+  shared_ptr<block_t> buffer;
+
+  int64_t offset;
+  int64_t nrows;
+  size_t row_nbytes;
+  int64_t rows_per_chunk;
+
+  // Current chunk
+  int64_t begin, count;
+  const unsigned char *chunk_ptr;
+
+public:
+  chunk_iterator_t() = delete;
+  chunk_iterator_t(const chunk_iterator_t &) = delete;
+  chunk_iterator_t(chunk_iterator_t &&) = default;
+  chunk_iterator_t &operator=(const chunk_iterator_t &) = delete;
+  chunk_iterator_t &operator=(chunk_iterator_t &&) = default;
+
+  chunk_iterator_t(const ndarray &arr, int64_t rows_per_chunk);
+
+  // Move to the next chunk (initially: the first chunk); return false after
+  // the last chunk
+  bool next();
+
+  // First row and number of rows of the current chunk
+  int64_t get_begin() const { return begin; }
+  int64_t get_count() const { return count; }
+
+  const void *ptr() const { return chunk_ptr; }
+  size_t nbytes() const { return count * row_nbytes; }
+};
+
 } // namespace ASDF
 
 #define ASDF_NDARRAY_HXX_DONE
@@ -0,0 +1,126 @@
+#ifndef ASDF_STREAM_HXX
+#define ASDF_STREAM_HXX
+
+#include <asdf/file.hxx>
+#include <asdf/io.hxx>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+namespace ASDF {
+using namespace std;
+
+// The checksum (MD5) of several buffers, taken together as one piece of
+// data. It is all zeros if checksums are not supported (see
+// `have_checksum`).
+array<unsigned char, 16> checksum(const vector<write_buffer_t> &buffers);
+
+// Incremental decoding of block data
+
+class stream_decoder_t;
+class stream_encoder_t;
+class stream_checksum_t;
+
+// Read and decompress the data of a block piecewise, holding only a small
+// part of the compressed data in memory at a time. The checksum is verified
+// when the end of the data has been reached.
+class block_reader_t {
+  shared_ptr<random_access_file_t> file;
+  int64_t in_pos, in_end; // range of compressed data in the file
+  uint64_t data_space;    // size of the decompressed data
+  uint64_t out_pos;       // number of bytes decompressed so far
+  array<unsigned char, 16> want_checksum;
+
+  vector<unsigned char> inbuf;
+  const unsigned char *in_ptr;
+  size_t in_avail;
+
+  unique_ptr<stream_decoder_t> decoder;
+  unique_ptr<stream_checksum_t> checksum;
+
+  void refill();
+  void finish();
+
+public:
+  block_reader_t() = delete;
+  block_reader_t(const block_reader_t &) = delete;
+  block_reader_t(block_reader_t &&);
+  block_reader_t &operator=(const block_reader_t &) = delete;
+  block_reader_t &operator=(block_reader_t &&);
+
+  block_reader_t(shared_ptr<random_access_file_t> file,
+                 const block_info_t &block_info,
+                 size_t buffer_size = 1024 * 1024);
+
+  ~block_reader_t();
+
+  // Whether blocks with this compression can be decoded incrementally
+  static bool can_stream(compression_t compression);
+
+  uint64_t size() const { return data_space; }
+  uint64_t tell() const { return out_pos; }
+  bool eof() const { return out_pos == data_space; }
+
+  // Decompress the next `nbytes` bytes into `buf`. Return the number of bytes
+  // decompressed, which is less than `nbytes` only at the end of the data.
+  size_t read(void *buf, size_t nbytes);
+};
+
+// Incremental encoding of block data
+
+// Compress data piecewise and write them to a sink as soon as possible,
+// holding only a small part of the compressed data in memory at a time. The
+// checksum of the compressed data is accumulated along the way.
+class block_writer_t {
+  output_sink_t &sink;
+  uint64_t in_nbytes;  // number of bytes passed in so far
+  uint64_t out_nbytes; // number of bytes written so far
+  bool finished;
+
+  vector<unsigned char> outbuf;
+  unsigned char *out_ptr;
+  size_t out_avail;
+
+  unique_ptr<stream_encoder_t> encoder;
+  unique_ptr<stream_checksum_t> checksum;
+  array<unsigned char, 16> final_checksum;
+
+  void flush();
+
+public:
+  block_writer_t() = delete;
+  block_writer_t(const block_writer_t &) = delete;
+  block_writer_t(block_writer_t &&) = delete;
+  block_writer_t &operator=(const block_writer_t &) = delete;
+  block_writer_t &operator=(block_writer_t &&) = delete;
+
+  block_writer_t(output_sink_t &sink, compression_t compression,
+                 int compression_level, size_t buffer_size = 1024 * 1024);
+
+  ~block_writer_t();
+
+  // Whether data can be compressed incrementally with this compression
+  static bool can_stream(compression_t compression);
+
+  // Compress and write `nbytes` bytes
+  void write(const void *buf, size_t nbytes);
+  // Write all remaining compressed data
+  void finish();
+
+  // Only available after `finish`
+  uint64_t get_data_space() const { return in_nbytes; }
+  uint64_t get_used_space() const { return out_nbytes; }
+  array<unsigned char, 16> get_checksum() const { return final_checksum; }
+};
+
+} // namespace ASDF
+
+#define ASDF_STREAM_HXX_DONE
+#endif // #ifndef ASDF_STREAM_HXX
+#ifndef ASDF_STREAM_HXX_DONE
+#error "Cyclic include depencency"
+#endif
@@ -0,0 +1,120 @@
+#include <asdf/allocator.hxx>
+
+#include <cassert>
+#include <mutex>
+#include <new>
+
+#if defined __unix__ || defined __APPLE__
+#include <sys/mman.h>
+#endif
+
+namespace ASDF {
+
+// Memory allocation for block data
+
+void *default_allocator_t::allocate(size_t nbytes) {
+  return ::operator new(nbytes);
+}
+
+void default_allocator_t::deallocate(void *ptr, size_t) {
+  ::operator delete(ptr);
+}
+
+aligned_allocator_t::aligned_allocator_t(size_t alignment)
+    : alignment(alignment) {
+  // The alignment must be a power of two
+  assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+}
+
+void *aligned_allocator_t::allocate(size_t nbytes) {
+  return ::operator new(nbytes, std::align_val_t(alignment));
+}
+
+void aligned_allocator_t::deallocate(void *ptr, size_t) {
+  ::operator delete(ptr, std::align_val_t(alignment));
+}
+
+namespace {
+constexpr size_t small_alignment = 64;
+
+size_t round_up_to_huge_pages(size_t nbytes) {
+  const size_t page_size = huge_page_allocator_t::huge_page_size;
+  return (nbytes + page_size - 1) / page_size * page_size;
+}
+} // namespace
+
+huge_page_allocator_t::huge_page_allocator_t(huge_pages_t huge_pages,
+                                             size_t min_nbytes)
+    : huge_pages(huge_pages), min_nbytes(min_nbytes) {}
+
+void *huge_page_allocator_t::allocate(size_t nbytes) {
+  if (nbytes < min_nbytes)
+    return ::operator new(nbytes, std::align_val_t(small_alignment));
+  const size_t length = round_up_to_huge_pages(nbytes);
+
+  if (huge_pages == huge_pages_t::explicit_pages) {
+#if defined __unix__ || defined __APPLE__
+    void *ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (ptr == MAP_FAILED) {
+      // Explicit huge pages are not available; fall back to transparent huge
+      // pages
+      ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (ptr == MAP_FAILED)
+        throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+      madvise(ptr, length, MADV_HUGEPAGE);
+#endif
+    }
+    return ptr;
+#endif
+  }
+
+  void *ptr = ::operator new(length, std::align_val_t(huge_page_size));
+#ifdef MADV_HUGEPAGE
+  // This is only a hint; we ignore errors
+  madvise(ptr, length, MADV_HUGEPAGE);
+#endif
+  return ptr;
+}
+
+void huge_page_allocator_t::deallocate(void *ptr, size_t nbytes) {
+  if (nbytes < min_nbytes) {
+    ::operator delete(ptr, std::align_val_t(small_alignment));
+    return;
+  }
+  const size_t length = round_up_to_huge_pages(nbytes);
+
+  if (huge_pages == huge_pages_t::explicit_pages) {
+#if defined __unix__ || defined __APPLE__
+    int ierr = munmap(ptr, length);
+    assert(!ierr);
+    return;
+#endif
+  }
+
+  ::operator delete(ptr, std::align_val_t(huge_page_size));
+}
+
+namespace {
+mutex default_block_allocator_mutex;
+shared_ptr<block_allocator_t> default_block_allocator =
+    make_shared<default_allocator_t>();
+} // namespace
+
+shared_ptr<block_allocator_t> get_default_block_allocator() {
+  lock_guard<mutex> lock(default_block_allocator_mutex);
+  return default_block_allocator;
+}
+
+void set_default_block_allocator(shared_ptr<block_allocator_t> allocator) {
+  assert(allocator);
+  lock_guard<mutex> lock(default_block_allocator_mutex);
+  default_block_allocator = std::move(allocator);
+}
+
+} // namespace ASDF
@@ -6,6 +6,8 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <string>
+#include <string_view>
 
 namespace ASDF {
 
@@ -26,7 +28,7 @@ asdf::asdf(const shared_ptr<reader_state> &rs, const YAML::Node &node,
   grp = std::make_shared<group>(rs, node);
 }
 
-asdf::asdf(const copy_state &cs, const asdf &project) {
+asdf::asdf(const copy_state &cs, const asdf &project) : tags(project.tags) {
   // for (const auto &kv : project.data) {
   //   const auto &key = kv.first;
   //   data[key] = make_shared<ndarray>(cs, *kv.second);
@@ -63,8 +65,19 @@ writer &asdf::to_yaml(writer &w) const {
   return w;
 }
 
+namespace {
+// The line ending the YAML document
+const string_view document_end = "\n...\n";
+
+// Parse a YAML document held in memory, without copying it
+YAML::Node load_document(const string &doc) {
+  memory_streambuf_t buf(doc.data(), doc.size());
+  istream is(&buf);
+  return YAML::Load(is);
+}
+} // namespace
+
 YAML::Node asdf::from_yaml(istream &is) {
-  ostringstream doc;
   const array<unsigned char, 5> magic{'#', 'A', 'S', 'D', 'F'};
   array<unsigned char, 5> header;
   is.read(reinterpret_cast<char *>(header.data()), header.size());
@@ -83,44 +96,294 @@ YAML::Node asdf::from_yaml(istream &is) {
     }
     exit(2);
   }
-  for (auto ch : header)
-    doc << ch;
+  string doc(header.begin(), header.end());
   // TODO: Check format version
 
-  // TODO: stream the file instead
-  while (is) {
-    string line;
-    getline(is, line);
-    doc << line << "\n";
-    if (line == "...")
-      return YAML::Load(doc.str());
+  const int64_t pos = is.tellg();
+  if (pos < 0) {
+    // The stream cannot seek (e.g. a pipe); read line by line, so that the
+    // stream ends up just after the document
+    is.clear();
+    while (is) {
+      string line;
+      getline(is, line);
+      doc.append(line).append("\n");
+      if (line == "...")
+        return load_document(doc);
+    }
+    cerr << "Stream input error\n";
+    exit(2);
+  }
+
+  // Read large chunks and search them for the end of the document, then
+  // place the stream just after the document
+  const size_t chunk_size = 1024 * 1024;
+  for (;;) {
+    const size_t old_size = doc.size();
+    doc.resize(old_size + chunk_size);
+    is.read(doc.data() + old_size, chunk_size);
+    const size_t nread = is.gcount();
+    doc.resize(old_size + nread);
+    // The marker might straddle the chunk boundary
+    const size_t search_begin =
+        old_size >= document_end.size() ? old_size - document_end.size() + 1
+                                        : 0;
+    size_t end = string_view(doc).find(document_end, search_begin);
+    if (end != string_view::npos) {
+      end += document_end.size();
+    } else if (nread < chunk_size) {
+      // The document may end at the end of the file
+      const string_view last_line = document_end.substr(0, 4);
+      if (doc.size() < last_line.size() ||
+          doc.compare(doc.size() - last_line.size(), last_line.size(),
+                      last_line) != 0) {
+        cerr << "Stream input error\n";
+        exit(2);
+      }
+      end = doc.size();
+    } else {
+      continue;
+    }
+    doc.resize(end);
+    is.clear();
+    is.seekg(pos + int64_t(end - header.size()));
+    return load_document(doc);
   }
-  cerr << "Stream input error\n";
-  exit(2);
 }
 
 asdf::asdf(const shared_ptr<istream> &pis, const string &filename,
-           const map<string, reader_t> &readers) {
+           const map<string, reader_t> &readers,
+           const reader_options &options) {
   auto node = from_yaml(*pis);
-  auto rs = make_shared<reader_state>(node, pis, filename);
+  auto rs = options.sequential
+                ? make_shared<reader_state>(node, *pis, options)
+                : make_shared<reader_state>(node, pis, filename, options);
   *this = asdf(rs, node, readers);
 }
 
-asdf::asdf(const string &filename, const map<string, reader_t> &readers)
-    : asdf(make_shared<ifstream>(filename, ios::binary | ios::in), filename,
-           readers) {}
+asdf::asdf(const string &filename, const map<string, reader_t> &readers,
+           const reader_options &options) {
+  if (options.sequential) {
+    *this = asdf(make_shared<ifstream>(filename, ios::binary | ios::in),
+                 filename, readers, options);
+    return;
+  }
+  const auto rs = reader_state::open(filename, options);
+  *this = asdf(rs, rs->get_tree(), readers);
+}
+
+asdf::asdf(const void *ptr, size_t nbytes, shared_ptr<const void> owner,
+           const map<string, reader_t> &readers,
+           const reader_options &options) {
+  const auto file = make_shared<memory_file_t>(ptr, nbytes, std::move(owner));
+  memory_streambuf_t buf(ptr, nbytes);
+  istream is(&buf);
+  auto node = from_yaml(is);
+  const int64_t pos = is.tellg();
+  auto rs = make_shared<reader_state>(node, file, pos, string(), options);
+  *this = asdf(rs, node, readers);
+}
 
 asdf asdf::copy(const copy_state &cs) const { return asdf(cs, *this); }
 
-void asdf::write(ostream &os) const {
-  writer w(os, tags);
+void asdf::write(output_sink_t &sink, const writer_options &options) const {
+  writer w(sink, tags, options);
   w << *this;
   w.flush();
+  if (options.sync)
+    sink.sync();
+}
+
+void asdf::write(ostream &os, const writer_options &options) const {
+  ostream_sink_t sink(os);
+  write(sink, options);
+}
+
+void asdf::write(const string &filename, const writer_options &options) const {
+  if (options.direct_io) {
+    direct_filebuf_t buf(filename);
+    assert(buf.is_open());
+    ostream os(&buf);
+    write(os, options);
+    buf.close();
+    return;
+  }
+  const auto sink = open_output_sink(filename);
+  write(*sink, options);
+}
+
+namespace {
+// The blocks in an existing file
+struct block_extents_t {
+  // Beginning of the header and end of the data of each block
+  vector<int64_t> begin, end;
+  int64_t file_size;
+  bool have_streamed_block;
+};
+
+block_extents_t find_blocks(const string &filename) {
+  const auto pis = make_shared<ifstream>(filename, ios::binary | ios::in);
+  assert(*pis);
+  const auto node = asdf::from_yaml(*pis);
+  const int64_t tree_end = pis->tellg();
+  const reader_state rs(node, pis, filename);
+  block_extents_t extents;
+  extents.file_size = rs.get_file()->get_size();
+  extents.have_streamed_block = false;
+  const int64_t nblocks = rs.get_block_count();
+  for (int64_t n = 0; n < nblocks; ++n) {
+    extents.have_streamed_block |= rs.get_block_flags(n) & block_flag_streamed;
+    extents.begin.push_back(rs.get_block_begin(n));
+    extents.end.push_back(rs.get_block_end(n));
+  }
+  assert(tree_end <= (nblocks > 0 ? extents.begin[0] : extents.file_size));
+  return extents;
+}
+
+// Keep the blocks of an existing file, moving the first `nmoved` blocks to
+// the end (as one contiguous range). Moved blocks are renumbered.
+existing_blocks_t keep_blocks(const string &filename,
+                              const block_extents_t &extents,
+                              int64_t nmoved) {
+  const int64_t nblocks = extents.begin.size();
+  existing_blocks_t existing;
+  existing.filename = filename;
+  existing.indices.resize(nblocks);
+  for (int64_t n = 0; n < nblocks; ++n) {
+    if (n < nmoved) {
+      existing.indices[n] = nblocks - nmoved + n;
+    } else {
+      existing.indices[n] = n - nmoved;
+      existing.positions.push_back(extents.begin[n]);
+    }
+  }
+  for (int64_t n = 0; n < nmoved; ++n)
+    existing.positions.push_back(extents.end.back() + extents.begin[n] -
+                                 extents.begin[0]);
+  return existing;
+}
+
+// The tree can extend up to the first block that is not moved (or to the end
+// of the file if there are no blocks)
+int64_t tree_space(const block_extents_t &extents, int64_t nmoved) {
+  const int64_t nblocks = extents.begin.size();
+  if (nblocks == 0)
+    return extents.file_size;
+  return nmoved < nblocks ? extents.begin[nmoved] : extents.end.back();
+}
+
+// Pad the tree to fill `space` bytes
+string pad_tree(string tree, int64_t space) {
+  const int64_t padding = space - int64_t(tree.size());
+  assert(padding >= 0);
+  if (padding > 0)
+    tree += string(padding - 1, ' ') + "\n";
+  return tree;
+}
+} // namespace
+
+void asdf::append(const string &filename,
+                  const writer_options &options) const {
+  const block_extents_t extents = find_blocks(filename);
+  const int64_t nblocks = extents.begin.size();
+  if (nblocks == 0) {
+    // There is nothing to keep
+    write(filename, options);
+    return;
+  }
+  // A streamed block must remain the last block
+  assert(!extents.have_streamed_block);
+
+  // Find out how many leading blocks need to move to the end of the file to
+  // make space for the new tree. If blocks are moved, padding is reserved
+  // again.
+  const auto emit_tree = [&](int64_t nmoved) {
+    counting_sink_t sink;
+    writer w(sink, tags, keep_blocks(filename, extents, nmoved), options);
+    w << *this;
+    const string tree = w.get_tree();
+    const int64_t nnew = w.get_new_block_count();
+    w.discard();
+    return make_pair(tree, nnew);
+  };
+  const auto fits = [&](int64_t tree_size, int64_t nmoved) {
+    const int64_t padding = nmoved == 0 ? 0 : options.tree_padding;
+    return tree_size + padding <= tree_space(extents, nmoved);
+  };
+  const auto [tree0, nnew] = emit_tree(0);
+  int64_t nmoved = 0;
+  if (!fits(tree0.size(), 0)) {
+    // Moving blocks renumbers them. Allow every `source` entry to grow to
+    // the length of the largest block index, then emit the tree again to
+    // confirm that it fits.
+    int64_t nsources = 0;
+    for (size_t pos = tree0.find("source:"); pos != string::npos;
+         pos = tree0.find("source:", pos + 1))
+      ++nsources;
+    const int64_t slack = nsources * to_string(nblocks + nnew - 1).size();
+    nmoved = 1;
+    while (nmoved < nblocks && !fits(tree0.size() + slack, nmoved))
+      ++nmoved;
+    while (!fits(emit_tree(nmoved).first.size(), nmoved)) {
+      assert(nmoved < nblocks);
+      ++nmoved;
+    }
+  }
+
+  // Replace the old block index, move blocks, and write the new blocks
+  const int64_t blocks_end = extents.end.back();
+  fd_sink_t sink(filename, blocks_end);
+  if (nmoved > 0) {
+    const auto file = open_random_access_file(filename);
+    vector<unsigned char> buffer(16 * 1024 * 1024);
+    const int64_t moved_end = extents.end[nmoved - 1];
+    for (int64_t pos = extents.begin[0]; pos < moved_end;) {
+      const size_t nbytes = min(int64_t(buffer.size()), moved_end - pos);
+      file->read(buffer.data(), nbytes, pos);
+      sink.write(buffer.data(), nbytes);
+      pos += nbytes;
+    }
+  }
+  writer w(sink, tags, keep_blocks(filename, extents, nmoved), options);
+  w << *this;
+  w.flush();
+
+  // Write the tree last, so that the old tree remains valid until all blocks
+  // are in place
+  const string tree = pad_tree(w.get_tree(), tree_space(extents, nmoved));
+  sink.patch(tree.data(), tree.size(), 0);
+}
+
+bool asdf::update_tree(const string &filename) const {
+  const block_extents_t extents = find_blocks(filename);
+  counting_sink_t no_sink;
+  writer w(no_sink, tags, keep_blocks(filename, extents, 0));
+  w << *this;
+  const int64_t space = tree_space(extents, 0);
+  const bool fits =
+      w.get_new_block_count() == 0 && int64_t(w.get_tree().size()) <= space;
+  if (!fits) {
+    w.discard();
+    return false;
+  }
+  const string tree = pad_tree(w.get_tree(), space);
+  // Do not truncate the file, since a streamed block might be growing
+  fd_sink_t sink(filename, extents.file_size, false);
+  sink.patch(tree.data(), tree.size(), 0);
+  return true;
+}
+
+size_t asdf::write(void *ptr, size_t nbytes,
+                   const writer_options &options) const {
+  memory_sink_t sink(ptr, nbytes);
+  write(sink, options);
+  return sink.get_size();
 }
 
-void asdf::write(const string &filename) const {
-  ofstream os(filename, ios::binary | ios::trunc | ios::out);
-  write(os);
+size_t asdf::encoded_size(const writer_options &options) const {
+  counting_sink_t sink;
+  write(sink, options);
+  return sink.get_size();
 }
 
 } // namespace ASDF
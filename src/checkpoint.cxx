@@ -0,0 +1,235 @@
+#include <asdf/checkpoint.hxx>
+
+#include <asdf/config.hxx>
+
+#include <yaml-cpp/yaml.h>
+
+#include <cassert>
+#include <optional>
+#include <sstream>
+
+namespace ASDF {
+
+void checkpoint_status_t::set_done() {
+  lock_guard<mutex> lock(mtx);
+  done = true;
+  cv.notify_all();
+}
+
+bool checkpoint_status_t::is_done() const {
+  lock_guard<mutex> lock(mtx);
+  return done;
+}
+
+void checkpoint_status_t::wait() const {
+  unique_lock<mutex> lock(mtx);
+  cv.wait(lock, [&] { return done; });
+}
+
+namespace {
+// Forward to another sink, counting the bytes written
+class progress_sink_t : public output_sink_t {
+  output_sink_t &sink;
+  const function<void(int64_t nbytes)> &progress;
+
+public:
+  progress_sink_t(output_sink_t &sink,
+                  const function<void(int64_t nbytes)> &progress)
+      : sink(sink), progress(progress) {}
+  virtual ~progress_sink_t() {}
+
+  virtual void writev(const vector<write_buffer_t> &buffers) override {
+    sink.writev(buffers);
+    int64_t nbytes = 0;
+    for (const auto &buffer : buffers)
+      nbytes += buffer.nbytes;
+    progress(nbytes);
+  }
+  virtual int64_t tell() const override { return sink.tell(); }
+  virtual bool is_seekable() const override { return sink.is_seekable(); }
+  virtual void patch(const void *buf, size_t nbytes, int64_t offset) override {
+    sink.patch(buf, nbytes, offset);
+  }
+  virtual void sync() override { sink.sync(); }
+};
+} // namespace
+
+checkpoint_writer_t::checkpoint_writer_t(
+    const writer_options &options, int64_t max_pending,
+    function<void(const checkpoint_status_t &status)> on_done)
+    : options(options), max_pending(max_pending), on_done(std::move(on_done)),
+      stopping(false) {
+  assert(!options.direct_io);
+  assert(max_pending >= 1);
+  worker = thread([this] { run(); });
+}
+
+checkpoint_writer_t::~checkpoint_writer_t() {
+  {
+    lock_guard<mutex> lock(mtx);
+    stopping = true;
+    cv.notify_all();
+  }
+  worker.join();
+  assert(pending.empty());
+}
+
+shared_ptr<const checkpoint_status_t>
+checkpoint_writer_t::write(const asdf &project, const string &filename) {
+  // Take the snapshot on the calling thread, while the caller is not
+  // modifying the project
+  copy_state cs{false, block_format_t::undefined, false,
+                compression_t::undefined, false, -1};
+  cs.copy_data = true;
+  cs.overwritten_file = filename;
+  checkpoint_t checkpoint{project.copy(cs),
+                          make_shared<checkpoint_status_t>(filename)};
+  const shared_ptr<const checkpoint_status_t> status = checkpoint.status;
+
+  unique_lock<mutex> lock(mtx);
+  // Apply backpressure
+  cv.wait(lock, [&] { return int64_t(pending.size()) < max_pending; });
+  pending.push_back(std::move(checkpoint));
+  cv.notify_all();
+  return status;
+}
+
+int64_t checkpoint_writer_t::get_pending_count() const {
+  lock_guard<mutex> lock(mtx);
+  return pending.size();
+}
+
+void checkpoint_writer_t::wait() const {
+  unique_lock<mutex> lock(mtx);
+  cv.wait(lock, [&] { return pending.empty(); });
+}
+
+void checkpoint_writer_t::run() {
+  for (;;) {
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [&] { return !pending.empty() || stopping; });
+    if (pending.empty())
+      return;
+    // The checkpoint stays in the queue while it is being written, so that
+    // it counts as pending
+    const asdf project = pending.front().project;
+    const shared_ptr<checkpoint_status_t> status = pending.front().status;
+    lock.unlock();
+
+    {
+      const auto file_sink = open_output_sink(status->get_filename());
+      const function<void(int64_t nbytes)> progress = [&](int64_t nbytes) {
+        status->add_nbytes_written(nbytes);
+      };
+      progress_sink_t sink(*file_sink, progress);
+      project.write(sink, options);
+    }
+    status->set_done();
+    if (on_done)
+      on_done(*status);
+
+    lock.lock();
+    pending.pop_front();
+    cv.notify_all();
+  }
+}
+
+namespace {
+// A hash of an array's data and metadata. Without a hash function, arrays
+// are always considered changed.
+std::optional<array<unsigned char, 16>> array_hash(const ndarray &arr) {
+  if (!have_checksum())
+    return {};
+  ostringstream metadata;
+  metadata << YAML::Dump(yaml_encode(*arr.get_datatype())) << "\n"
+           << yaml_encode(arr.get_byteorder()) << "\n"
+           << arr.get_offset() << "\n";
+  for (const int64_t sz : arr.get_shape())
+    metadata << sz << " ";
+  metadata << "\n";
+  for (const int64_t str : arr.get_strides())
+    metadata << str << " ";
+  metadata << "\n";
+  const string metadata_str = metadata.str();
+
+  // storage management
+  const bool old_ready = arr.get_data().ready();
+  const shared_ptr<block_t> data = arr.get_data().get();
+
+  const array<unsigned char, 16> hash =
+      checksum({{metadata_str.data(), metadata_str.size()},
+                {data->ptr(), data->nbytes()}});
+
+  // storage management
+  if (!old_ready)
+    arr.get_data().forget();
+  return hash;
+}
+
+// The name under which file `target` is referred to from file `filename`
+string reference_base(const string &target, const string &filename) {
+  if (!target.empty() && target[0] == '/')
+    return target;
+  const auto dirname = [](const string &name) {
+    const auto slashpos = name.rfind('/');
+    return slashpos == string::npos ? string() : name.substr(0, slashpos + 1);
+  };
+  const string dir = dirname(target);
+  // The files need to be in the same directory
+  assert(dir == dirname(filename));
+  return target.substr(dir.size());
+}
+} // namespace
+
+void incremental_writer_t::replace_unchanged(
+    shared_ptr<entry> &ent, vector<string> &path, const string &filename,
+    map<vector<string>, stored_array_t> &new_stored) {
+  if (const auto grp = ent->get_maybe_group()) {
+    for (auto &[key, value] : *grp) {
+      path.push_back(key);
+      replace_unchanged(value, path, filename, new_stored);
+      path.pop_back();
+    }
+  } else if (const auto seq = ent->get_maybe_sequence()) {
+    for (size_t n = 0; n < seq->size(); ++n) {
+      path.push_back(to_string(n));
+      replace_unchanged(seq->at(n), path, filename, new_stored);
+      path.pop_back();
+    }
+  } else if (const auto arr = ent->get_maybe_ndarray()) {
+    if (arr->get_streamed())
+      return;
+    const auto hash = array_hash(*arr);
+    if (!hash)
+      return;
+    const auto iter = stored.find(path);
+    if (iter != stored.end() && iter->second.hash == *hash) {
+      // Refer to the file that holds the data
+      const string &target = iter->second.filename;
+      new_stored[path] = iter->second;
+      ent = make_shared<reference_entry>(
+          reference(reference_base(target, filename), path));
+    } else {
+      new_stored[path] = stored_array_t{*hash, filename};
+    }
+  }
+}
+
+asdf incremental_writer_t::prepare(const asdf &project,
+                                   const string &filename) {
+  // Copy the tree (but not the array data), so that entries can be replaced
+  const copy_state cs{false, block_format_t::undefined, false,
+                      compression_t::undefined, false, -1};
+  asdf incremental = project.copy(cs);
+  map<vector<string>, stored_array_t> new_stored;
+  if (const auto grp = incremental.get_group()) {
+    for (auto &[key, value] : *grp->get_group()) {
+      vector<string> path{key};
+      replace_unchanged(value, path, filename, new_stored);
+    }
+  }
+  stored = std::move(new_stored);
+  return incremental;
+}
+
+} // namespace ASDF
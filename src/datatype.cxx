@@ -1,6 +1,10 @@
 #include <asdf/config.hxx>
 #include <asdf/datatype.hxx>
 
+#include <cassert>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
 #include <limits>
 #include <regex>
 #include <sstream>
@@ -301,6 +305,147 @@ void yaml_decode(const YAML::Node &node, float32_t &val) {
 void yaml_decode(const YAML::Node &node, float64_t &val) {
   val = node.as<float64_t>();
 }
+namespace {
+// The character classes used by yaml-cpp and by `std::istream` in the "C"
+// locale
+bool is_lower(char ch) { return ch >= 'a' && ch <= 'z'; }
+bool is_upper(char ch) { return ch >= 'A' && ch <= 'Z'; }
+bool is_digit(char ch) { return ch >= '0' && ch <= '9'; }
+bool is_space(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\v' || ch == '\f' ||
+         ch == '\r';
+}
+
+// Whether only whitespace follows (an istream conversion may be followed by
+// whitespace, but not preceded)
+bool only_space(const char *ptr, const char *end) {
+  for (; ptr < end; ++ptr)
+    if (!is_space(*ptr))
+      return false;
+  return true;
+}
+
+// Compare, ignoring the case of `str`
+bool equal_lower(const string &str, const char *lower) {
+  size_t n = 0;
+  for (; n < str.size() && lower[n]; ++n)
+    if ((is_upper(str[n]) ? str[n] - 'A' + 'a' : str[n]) != lower[n])
+      return false;
+  return n == str.size() && !lower[n];
+}
+} // namespace
+
+optional<bool> parse_yaml_bool(const string &str) {
+  // yaml-cpp accepts lowercase, UPPERCASE, and Capitalized names
+  if (str.empty())
+    return {};
+  bool all_lower = true, rest_lower = true, rest_upper = true;
+  for (size_t n = 0; n < str.size(); ++n) {
+    all_lower &= is_lower(str[n]);
+    if (n > 0) {
+      rest_lower &= is_lower(str[n]);
+      rest_upper &= is_upper(str[n]);
+    }
+  }
+  if (!all_lower && !(is_upper(str[0]) && (rest_lower || rest_upper)))
+    return {};
+  static const char *const names[][2] = {
+      {"y", "n"}, {"yes", "no"}, {"true", "false"}, {"on", "off"}};
+  for (const auto &name : names) {
+    if (equal_lower(str, name[0]))
+      return true;
+    if (equal_lower(str, name[1]))
+      return false;
+  }
+  return {};
+}
+
+optional<int64_t> parse_yaml_int(const string &str) {
+  // An optional sign, then hexadecimal ("0x"), octal ("0"), or decimal
+  // digits
+  const char *ptr = str.data();
+  const char *const end = ptr + str.size();
+  bool negative = false;
+  if (ptr < end && (*ptr == '+' || *ptr == '-')) {
+    negative = *ptr == '-';
+    ++ptr;
+  }
+  int base = 10;
+  if (ptr < end && *ptr == '0') {
+    if (ptr + 1 < end && (ptr[1] == 'x' || ptr[1] == 'X')) {
+      base = 16;
+      ptr += 2;
+    } else {
+      base = 8;
+    }
+  }
+  uint64_t magnitude;
+  const auto [digits_end, ec] = from_chars(ptr, end, magnitude, base);
+  if (ec != errc() || !only_space(digits_end, end))
+    return {};
+  const uint64_t max_magnitude =
+      uint64_t(numeric_limits<int64_t>::max()) + negative;
+  if (magnitude > max_magnitude)
+    return {};
+  return negative ? int64_t(0 - magnitude) : int64_t(magnitude);
+}
+
+optional<float64_t> parse_yaml_float(const string &str) {
+  // An optional sign, digits with at most one decimal point, and an optional
+  // exponent
+  const char *const begin = str.data();
+  const char *const end = begin + str.size();
+  const char *ptr = begin;
+  if (ptr < end && (*ptr == '+' || *ptr == '-'))
+    ++ptr;
+  bool have_mantissa = false, have_point = false;
+  for (; ptr < end; ++ptr) {
+    if (is_digit(*ptr))
+      have_mantissa = true;
+    else if (*ptr == '.' && !have_point)
+      have_point = true;
+    else
+      break;
+  }
+  bool valid = have_mantissa;
+  if (valid && ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+    ++ptr;
+    if (ptr < end && (*ptr == '+' || *ptr == '-'))
+      ++ptr;
+    valid = ptr < end && is_digit(*ptr);
+    while (ptr < end && is_digit(*ptr))
+      ++ptr;
+  }
+  if (valid && only_space(ptr, end)) {
+    // `from_chars` does not accept a leading plus sign
+    const char *const number = *begin == '+' ? begin + 1 : begin;
+    float64_t val;
+    // Some standard libraries (e.g. libc++ before LLVM 20) do not provide
+    // `from_chars` for floating-point numbers
+#ifdef __cpp_lib_to_chars
+    const auto [number_end, ec] = from_chars(number, ptr, val);
+    if (ec == errc()) {
+      assert(number_end == ptr);
+      return val;
+    }
+    assert(ec == errc::result_out_of_range);
+#endif
+    // Values that underflow are accepted, values that overflow are not
+    val = strtod(number, nullptr);
+    if (isinf(val))
+      return {};
+    return val;
+  }
+  if (str == ".inf" || str == ".Inf" || str == ".INF" || str == "+.inf" ||
+      str == "+.Inf" || str == "+.INF")
+    return numeric_limits<float64_t>::infinity();
+  if (str == "-.inf" || str == "-.Inf" || str == "-.INF")
+    return -numeric_limits<float64_t>::infinity();
+  if (str == ".nan" || str == ".NaN" || str == ".NAN")
+    return numeric_limits<float64_t>::quiet_NaN();
+  return {};
+}
+
 namespace {
 template <typename T>
 void yaml_decode_complex(const YAML::Node &node, complex<T> &val) {
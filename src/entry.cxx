@@ -6,19 +6,11 @@
 #include <cstdlib>
 #include <optional>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 namespace ASDF {
 
-namespace {
-template <typename T> std::optional<T> try_parse_yaml(const YAML::Node &node) {
-  try {
-    return node.as<T>();
-  } catch (const YAML::BadConversion &e) {
-    return std::optional<T>();
-  }
-}
-} // namespace
-
 ////////////////////////////////////////////////////////////////////////////////
 
 std::ostream &operator<<(std::ostream &os, entry_type_t entry_type) {
@@ -111,23 +103,81 @@ reference_entry::reference_entry(const copy_state &cs,
                                  const reference_entry &ref)
     : value(std::make_shared<reference>(cs, *ref.value)) {}
 
+std::shared_ptr<entry> reference_entry::copy(const copy_state &cs) const {
+  if (!cs.resolve_references)
+    return std::make_shared<reference_entry>(cs, *this);
+  // Follow the chain of references, and copy the entry it ends in
+  auto [rs, node] = value->resolve();
+  return make_entry(rs, node)->copy(cs);
+}
+
 writer &reference_entry::to_yaml(writer &w) const { return w << *value; }
 
 sequence::sequence(const shared_ptr<reader_state> &rs, const YAML::Node &node)
     : sequence() {
   assert(node.IsSequence());
-  for (const auto &value : node)
-    push_back(make_entry(rs, value));
+  // The entries are created when they are accessed
+  entries->resize(node.size());
+  pending = std::make_shared<pending_entries_t>();
+  pending->rs = rs;
+  pending->node = node;
 }
 
 sequence::sequence(const copy_state &cs, const sequence &from) : sequence() {
-  for (const auto &value : *from.entries)
+  for (const auto &value : *from.get_sequence())
     push_back(value->copy(cs));
 }
 
+// Entries are created without holding the lock, since creating an entry
+// may access other entries (e.g. to resolve references)
+
+void sequence::materialize() const {
+  if (!pending)
+    return;
+  std::vector<std::pair<std::size_t, YAML::Node>> missing;
+  {
+    std::lock_guard<std::mutex> lock(pending->mtx);
+    if (pending->complete)
+      return;
+    const YAML::Node &node = pending->node;
+    for (std::size_t n = 0; n < node.size(); ++n)
+      if (!entries->at(n))
+        missing.emplace_back(n, node[n]);
+  }
+  std::vector<std::shared_ptr<entry>> created;
+  for (const auto &[n, value] : missing)
+    created.push_back(make_entry(pending->rs, value));
+  std::lock_guard<std::mutex> lock(pending->mtx);
+  for (std::size_t i = 0; i < missing.size(); ++i) {
+    auto &slot = entries->at(missing[i].first);
+    if (!slot)
+      slot = created[i];
+  }
+  pending->complete = true;
+}
+
+std::shared_ptr<entry> sequence::at(const std::size_t n) const {
+  if (!pending)
+    return entries->at(n);
+  YAML::Node value;
+  {
+    std::lock_guard<std::mutex> lock(pending->mtx);
+    if (pending->complete || n >= entries->size() || entries->at(n))
+      return entries->at(n);
+    const YAML::Node &node = pending->node;
+    value.reset(node[n]);
+  }
+  const auto created = make_entry(pending->rs, value);
+  std::lock_guard<std::mutex> lock(pending->mtx);
+  auto &slot = entries->at(n);
+  if (!slot)
+    slot = created;
+  return slot;
+}
+
 writer &sequence::to_yaml(writer &w) const {
   w << YAML::BeginSeq;
-  for (const auto &value : *entries)
+  for (const auto &value : *get_sequence())
     w << *value;
   w << YAML::EndSeq;
   return w;
@@ -136,18 +186,74 @@ writer &sequence::to_yaml(writer &w) const {
 group::group(const shared_ptr<reader_state> &rs, const YAML::Node &node)
     : group() {
   assert(node.IsMap());
-  for (const auto &key_value : node)
-    insert({key_value.first.Scalar(), make_entry(rs, key_value.second)});
+  // The entries are created when they are accessed
+  pending = std::make_shared<pending_entries_t>();
+  pending->rs = rs;
+  pending->node = node;
 }
 
 group::group(const copy_state &cs, const group &from) : group() {
-  for (const auto &[key, value] : *from.entries)
+  for (const auto &[key, value] : *from.get_group())
     insert({key, value->copy(cs)});
 }
 
+void group::materialize() const {
+  if (!pending)
+    return;
+  std::vector<std::pair<std::string, YAML::Node>> missing;
+  {
+    std::lock_guard<std::mutex> lock(pending->mtx);
+    if (pending->complete)
+      return;
+    for (const auto &key_value : pending->node) {
+      const std::string &key = key_value.first.Scalar();
+      if (!entries->count(key))
+        missing.emplace_back(key, key_value.second);
+    }
+  }
+  std::vector<std::shared_ptr<entry>> created;
+  for (const auto &[key, value] : missing)
+    created.push_back(make_entry(pending->rs, value));
+  std::lock_guard<std::mutex> lock(pending->mtx);
+  // Of duplicate keys, the first one wins
+  for (std::size_t i = 0; i < missing.size(); ++i)
+    entries->emplace(missing[i].first, created[i]);
+  pending->complete = true;
+}
+
+std::size_t group::count(const std::string &key) const {
+  if (pending) {
+    std::lock_guard<std::mutex> lock(pending->mtx);
+    if (!pending->complete && !entries->count(key)) {
+      const YAML::Node &node = pending->node;
+      return bool(node[key]);
+    }
+  }
+  return entries->count(key);
+}
+
+std::shared_ptr<entry> group::at(const std::string &key) const {
+  if (!pending)
+    return entries->at(key);
+  YAML::Node value;
+  {
+    std::lock_guard<std::mutex> lock(pending->mtx);
+    if (pending->complete || entries->count(key))
+      return entries->at(key);
+    const YAML::Node &node = pending->node;
+    const YAML::Node found = node[key];
+    if (!found)
+      return entries->at(key);
+    value.reset(found);
+  }
+  const auto created = make_entry(pending->rs, value);
+  std::lock_guard<std::mutex> lock(pending->mtx);
+  return entries->emplace(key, created).first->second;
+}
+
 writer &group::to_yaml(writer &w) const {
   w << YAML::BeginMap;
-  for (const auto &[key, value] : *entries)
+  for (const auto &[key, value] : *get_group())
     w << YAML::Key << key << YAML::Value << *value;
   w << YAML::EndMap;
   return w;
@@ -183,22 +289,15 @@ std::shared_ptr<entry> make_entry(const std::shared_ptr<reader_state> &rs,
 
   // Scalar nodes can be either boo, int, float, or string. Try in this order.
   if (node.IsScalar()) {
-    const auto bool8 = try_parse_yaml<bool>(node);
-    if (bool8)
+    const std::string &scalar = node.Scalar();
+    if (const auto bool8 = parse_yaml_bool(scalar))
       return std::make_shared<bool_entry>(*bool8);
-  }
-  if (node.IsScalar()) {
-    const auto int64 = try_parse_yaml<int64_t>(node);
-    if (int64)
+    if (const auto int64 = parse_yaml_int(scalar))
       return std::make_shared<int_entry>(*int64);
-  }
-  if (node.IsScalar()) {
-    const auto float64 = try_parse_yaml<float64_t>(node);
-    if (float64)
+    if (const auto float64 = parse_yaml_float(scalar))
       return std::make_shared<float_entry>(*float64);
+    return std::make_shared<string_entry>(scalar);
   }
-  if (node.IsScalar())
-    return std::make_shared<string_entry>(node.Scalar());
 
   // Sequences are straightforward.
   if (node.IsSequence())
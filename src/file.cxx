@@ -0,0 +1,929 @@
+#include <asdf/file.hxx>
+
+#include <asdf/config.hxx>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <new>
+
+#if defined __unix__ || defined __APPLE__
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define ASDF_HAVE_PREAD 1
+#endif
+
+#ifdef ASDF_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace ASDF {
+
+// Random-access input files
+
+void random_access_file_t::read_batch(
+    const vector<read_request_t> &requests,
+    const function<void(size_t)> &done) const {
+  for (size_t i = 0; i < requests.size(); ++i) {
+    const auto &request = requests[i];
+    read(request.buf, request.nbytes, request.offset);
+    done(i);
+  }
+}
+
+#ifdef ASDF_HAVE_LIBURING
+
+namespace {
+// Submit at most this many reads at once
+constexpr unsigned io_uring_queue_depth = 64;
+} // namespace
+
+struct fd_file_t::io_uring_state_t {
+  struct io_uring ring;
+  bool valid; // false if io_uring is not available at run time
+
+  io_uring_state_t() {
+    valid = io_uring_queue_init(io_uring_queue_depth, &ring, 0) >= 0;
+  }
+  ~io_uring_state_t() {
+    if (valid)
+      io_uring_queue_exit(&ring);
+  }
+};
+
+#else
+
+struct fd_file_t::io_uring_state_t {};
+
+#endif
+
+#ifdef ASDF_HAVE_PREAD
+
+fd_file_t::fd_file_t(const string &filename, bool direct_io)
+    : direct_fd(-1), direct_io(direct_io) {
+  fd = ::open(filename.c_str(), O_RDONLY);
+  assert(fd >= 0);
+  if (direct_io) {
+    // If the file system does not support direct I/O then `direct_fd` remains
+    // invalid
+#if defined O_DIRECT
+    direct_fd = ::open(filename.c_str(), O_RDONLY | O_DIRECT);
+#elif defined F_NOCACHE
+    direct_fd = ::open(filename.c_str(), O_RDONLY);
+    if (direct_fd >= 0 && fcntl(direct_fd, F_NOCACHE, 1) != 0) {
+      ::close(direct_fd);
+      direct_fd = -1;
+    }
+#endif
+  }
+}
+
+fd_file_t::~fd_file_t() {
+  if (direct_fd >= 0)
+    ::close(direct_fd);
+  ::close(fd);
+}
+
+size_t fd_file_t::read_some(void *buf, size_t nbytes, int64_t offset) const {
+  assert(offset >= 0);
+  unsigned char *ptr = static_cast<unsigned char *>(buf);
+  size_t nread = 0;
+  while (nread < nbytes) {
+    const ssize_t res = ::pread(fd, ptr + nread, nbytes - nread,
+                                off_t(offset + int64_t(nread)));
+    if (res < 0 && errno == EINTR)
+      continue;
+    assert(res >= 0);
+    if (res == 0)
+      break; // end of file
+    nread += res;
+  }
+  return nread;
+}
+
+int64_t fd_file_t::get_size() const {
+  struct stat st;
+  const int ierr = ::fstat(fd, &st);
+  assert(!ierr);
+  return st.st_size;
+}
+
+void fd_file_t::will_need(int64_t offset, size_t nbytes) const {
+  if (direct_io)
+    return;
+#ifdef POSIX_FADV_WILLNEED
+  // This is only a hint; we ignore errors
+  posix_fadvise(fd, off_t(offset), off_t(nbytes), POSIX_FADV_WILLNEED);
+#endif
+}
+
+namespace {
+// An aligned bounce buffer for direct I/O
+class aligned_buffer_t {
+  size_t nbytes;
+  unsigned char *data;
+
+public:
+  aligned_buffer_t() = delete;
+  aligned_buffer_t(const aligned_buffer_t &) = delete;
+  aligned_buffer_t(aligned_buffer_t &&) = delete;
+  aligned_buffer_t &operator=(const aligned_buffer_t &) = delete;
+  aligned_buffer_t &operator=(aligned_buffer_t &&) = delete;
+
+  aligned_buffer_t(size_t nbytes)
+      : nbytes(nbytes),
+        data(static_cast<unsigned char *>(::operator new(
+            nbytes, std::align_val_t(direct_io_alignment)))) {}
+  ~aligned_buffer_t() {
+    ::operator delete(data, std::align_val_t(direct_io_alignment));
+  }
+
+  unsigned char *ptr() const { return data; }
+  size_t size() const { return nbytes; }
+};
+
+constexpr size_t direct_io_bounce_size = 16 * 1024 * 1024;
+
+size_t round_up_to_alignment(size_t nbytes) {
+  return (nbytes + direct_io_alignment - 1) / direct_io_alignment *
+         direct_io_alignment;
+}
+
+// Read up to `nbytes` bytes; stop early at the end of the file or after an
+// unaligned partial read
+size_t pread_direct(int fd, unsigned char *buf, size_t nbytes,
+                    int64_t offset) {
+  size_t nread = 0;
+  while (nread < nbytes) {
+    const ssize_t res =
+        ::pread(fd, buf + nread, nbytes - nread, off_t(offset + nread));
+    if (res < 0 && errno == EINTR)
+      continue;
+    assert(res >= 0);
+    if (res == 0)
+      break; // end of file
+    nread += res;
+    if (nread % direct_io_alignment != 0)
+      break; // cannot continue at an unaligned offset
+  }
+  return nread;
+}
+} // namespace
+
+void fd_file_t::read_direct(void *buf, size_t nbytes, int64_t offset) const {
+  if (direct_fd < 0) {
+    // Direct I/O is not supported; read via the page cache, and release the
+    // pages again afterwards
+    const size_t nread = read_some(buf, nbytes, offset);
+    assert(nread == nbytes);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, off_t(offset), off_t(nbytes), POSIX_FADV_DONTNEED);
+#endif
+    return;
+  }
+
+  unsigned char *ptr = static_cast<unsigned char *>(buf);
+  int64_t pos = offset;
+  size_t remaining = nbytes;
+  unique_ptr<aligned_buffer_t> bounce;
+  while (remaining > 0) {
+    if (uintptr_t(ptr) % direct_io_alignment == 0 &&
+        pos % direct_io_alignment == 0 && remaining >= direct_io_alignment) {
+      // The destination is aligned; read directly
+      const size_t nread =
+          pread_direct(direct_fd, ptr,
+                       remaining / direct_io_alignment * direct_io_alignment,
+                       pos);
+      assert(nread > 0); // unexpected end of file
+      ptr += nread;
+      pos += nread;
+      remaining -= nread;
+      continue;
+    }
+    // Read aligned pieces into the bounce buffer and copy the requested part
+    if (!bounce)
+      bounce = make_unique<aligned_buffer_t>(direct_io_bounce_size);
+    const int64_t aligned_pos =
+        pos / int64_t(direct_io_alignment) * int64_t(direct_io_alignment);
+    const size_t skip = pos - aligned_pos;
+    const size_t want =
+        min(bounce->size(), round_up_to_alignment(skip + remaining));
+    const size_t nread =
+        pread_direct(direct_fd, bounce->ptr(), want, aligned_pos);
+    assert(nread > skip); // unexpected end of file
+    const size_t ncopy = min(remaining, nread - skip);
+    memcpy(ptr, bounce->ptr() + skip, ncopy);
+    ptr += ncopy;
+    pos += ncopy;
+    remaining -= ncopy;
+  }
+}
+
+#ifdef ASDF_HAVE_LIBURING
+
+namespace {
+// Split large requests into pieces of at most this size
+constexpr size_t io_uring_max_piece = size_t(1) << 30;
+
+struct read_piece_t {
+  size_t request;
+  unsigned char *buf;
+  size_t nbytes;
+  int64_t offset;
+};
+
+void read_batch_io_uring(struct io_uring &ring, int fd,
+                         const vector<read_request_t> &requests,
+                         const function<void(size_t)> &done) {
+  const unsigned depth = io_uring_queue_depth;
+
+  // Split requests into pieces
+  vector<read_piece_t> pending;
+  vector<size_t> remaining(requests.size());
+  for (size_t i = 0; i < requests.size(); ++i) {
+    const auto &request = requests[i];
+    remaining[i] = request.nbytes;
+    if (request.nbytes == 0) {
+      done(i);
+      continue;
+    }
+    for (size_t pos = 0; pos < request.nbytes; pos += io_uring_max_piece)
+      pending.push_back(
+          {i, static_cast<unsigned char *>(request.buf) + pos,
+           min(io_uring_max_piece, request.nbytes - pos),
+           request.offset + int64_t(pos)});
+  }
+  // Submit in file order
+  reverse(pending.begin(), pending.end());
+
+  // Pieces that are currently in flight
+  vector<read_piece_t> inflight(depth);
+  vector<size_t> free_slots;
+  for (size_t slot = 0; slot < depth; ++slot)
+    free_slots.push_back(depth - 1 - slot);
+
+  size_t ninflight = 0;
+  while (!pending.empty() || ninflight > 0) {
+    // Submit as many pieces as possible
+    unsigned nsubmit = 0;
+    while (!pending.empty() && !free_slots.empty()) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+      if (!sqe)
+        break;
+      const size_t slot = free_slots.back();
+      free_slots.pop_back();
+      inflight[slot] = pending.back();
+      pending.pop_back();
+      const auto &piece = inflight[slot];
+      io_uring_prep_read(sqe, fd, piece.buf, unsigned(piece.nbytes),
+                         piece.offset);
+      io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(uintptr_t(slot)));
+      ++nsubmit;
+    }
+    if (nsubmit > 0) {
+      const int ires = io_uring_submit(&ring);
+      assert(ires >= 0);
+      ninflight += nsubmit;
+    }
+
+    // Wait for a completion
+    struct io_uring_cqe *cqe;
+    int ires = io_uring_wait_cqe(&ring, &cqe);
+    if (ires == -EINTR)
+      continue;
+    assert(ires == 0);
+    const size_t slot = uintptr_t(io_uring_cqe_get_data(cqe));
+    const int res = cqe->res;
+    io_uring_cqe_seen(&ring, cqe);
+    --ninflight;
+    read_piece_t piece = inflight[slot];
+    free_slots.push_back(slot);
+    if (res == -EINTR || res == -EAGAIN) {
+      // Retry
+      pending.push_back(piece);
+      continue;
+    }
+    assert(res > 0); // error or unexpected end of file
+    if (size_t(res) < piece.nbytes) {
+      // Short read; read the remainder
+      pending.push_back({piece.request, piece.buf + res, piece.nbytes - res,
+                         piece.offset + res});
+    }
+    remaining[piece.request] -= res;
+    if (remaining[piece.request] == 0)
+      done(piece.request);
+  }
+}
+} // namespace
+
+void fd_file_t::read_batch(const vector<read_request_t> &requests,
+                           const function<void(size_t)> &done) const {
+  // Direct I/O goes through the aligned bounce buffer in `read`
+  if (!direct_io) {
+    unique_lock<mutex> lock(ring_mtx, try_to_lock);
+    if (lock.owns_lock()) {
+      if (!ring)
+        ring = make_unique<io_uring_state_t>();
+      if (ring->valid) {
+        read_batch_io_uring(ring->ring, fd, requests, done);
+        return;
+      }
+    }
+  }
+  random_access_file_t::read_batch(requests, done);
+}
+
+#else
+
+void fd_file_t::read_batch(const vector<read_request_t> &requests,
+                           const function<void(size_t)> &done) const {
+  random_access_file_t::read_batch(requests, done);
+}
+
+#endif
+
+#else
+
+fd_file_t::fd_file_t(const string &filename, bool direct_io)
+    : fd(-1), direct_fd(-1), direct_io(direct_io) {
+  // `pread` is not available
+  assert(0);
+}
+
+fd_file_t::~fd_file_t() {}
+
+size_t fd_file_t::read_some(void *buf, size_t nbytes, int64_t offset) const {
+  assert(0);
+  return 0;
+}
+
+int64_t fd_file_t::get_size() const {
+  assert(0);
+  return 0;
+}
+
+void fd_file_t::read_batch(const vector<read_request_t> &requests,
+                           const function<void(size_t)> &done) const {
+  assert(0);
+}
+
+void fd_file_t::read_direct(void *buf, size_t nbytes, int64_t offset) const {
+  assert(0);
+}
+
+void fd_file_t::will_need(int64_t offset, size_t nbytes) const {}
+
+#endif
+
+void fd_file_t::read(void *buf, size_t nbytes, int64_t offset) const {
+  if (direct_io && nbytes >= direct_io_min_nbytes) {
+    read_direct(buf, nbytes, offset);
+    return;
+  }
+  const size_t nread = read_some(buf, nbytes, offset);
+  assert(nread == nbytes);
+}
+
+istream_file_t::istream_file_t(shared_ptr<istream> pis1)
+    : pis(std::move(pis1)) {
+  assert(pis);
+}
+
+size_t istream_file_t::read_some(void *buf, size_t nbytes,
+                                 int64_t offset) const {
+  lock_guard<mutex> lock(mtx);
+  istream &is = *pis;
+  is.clear();
+  is.seekg(offset);
+  assert(is);
+  is.read(static_cast<char *>(buf), nbytes);
+  const size_t nread = is.gcount();
+  is.clear();
+  return nread;
+}
+
+void istream_file_t::read(void *buf, size_t nbytes, int64_t offset) const {
+  const size_t nread = read_some(buf, nbytes, offset);
+  assert(nread == nbytes);
+}
+
+int64_t istream_file_t::get_size() const {
+  lock_guard<mutex> lock(mtx);
+  istream &is = *pis;
+  is.clear();
+  is.seekg(0, ios_base::end);
+  const int64_t size = is.tellg();
+  assert(size >= 0);
+  return size;
+}
+
+memory_file_t::memory_file_t(const void *ptr, size_t nbytes,
+                             shared_ptr<const void> owner)
+    : data(static_cast<const unsigned char *>(ptr)), size(nbytes),
+      owner(std::move(owner)) {
+  assert(ptr || nbytes == 0);
+}
+
+size_t memory_file_t::read_some(void *buf, size_t nbytes,
+                                int64_t offset) const {
+  assert(offset >= 0);
+  if (uint64_t(offset) >= size)
+    return 0;
+  const size_t nread = min(nbytes, size_t(size - offset));
+  memcpy(buf, data + offset, nread);
+  return nread;
+}
+
+void memory_file_t::read(void *buf, size_t nbytes, int64_t offset) const {
+  const size_t nread = read_some(buf, nbytes, offset);
+  assert(nread == nbytes);
+}
+
+int64_t memory_file_t::get_size() const { return size; }
+
+const void *memory_file_t::map(int64_t offset, size_t nbytes) const {
+  assert(offset >= 0 && uint64_t(offset) + nbytes <= size);
+  return data + offset;
+}
+
+memory_streambuf_t::memory_streambuf_t(const void *ptr, size_t nbytes) {
+  char *const begin = const_cast<char *>(static_cast<const char *>(ptr));
+  setg(begin, begin, begin + nbytes);
+}
+
+memory_streambuf_t::pos_type
+memory_streambuf_t::seekoff(off_type off, ios_base::seekdir dir,
+                            ios_base::openmode which) {
+  if (!(which & ios_base::in))
+    return pos_type(off_type(-1));
+  off_type pos;
+  switch (dir) {
+  case ios_base::beg:
+    pos = off;
+    break;
+  case ios_base::cur:
+    pos = gptr() - eback() + off;
+    break;
+  case ios_base::end:
+    pos = egptr() - eback() + off;
+    break;
+  default:
+    return pos_type(off_type(-1));
+  }
+  return seekpos(pos_type(pos), which);
+}
+
+memory_streambuf_t::pos_type
+memory_streambuf_t::seekpos(pos_type pos, ios_base::openmode which) {
+  const off_type off = pos;
+  if (!(which & ios_base::in) || off < 0 || off > egptr() - eback())
+    return pos_type(off_type(-1));
+  setg(eback(), eback() + off, egptr());
+  return pos;
+}
+
+shared_ptr<random_access_file_t>
+open_random_access_file(const string &filename, bool direct_io) {
+#ifdef ASDF_HAVE_PREAD
+  return make_shared<fd_file_t>(filename, direct_io);
+#else
+  // Direct I/O is not supported
+  return make_shared<istream_file_t>(
+      make_shared<ifstream>(filename, ios::binary | ios::in));
+#endif
+}
+
+bool same_file(const string &filename1, const string &filename2) {
+  if (filename1.empty() || filename2.empty())
+    return false;
+  error_code ec;
+  return filesystem::equivalent(filename1, filename2, ec);
+}
+
+// Output files
+
+#ifdef ASDF_HAVE_PREAD
+
+direct_filebuf_t::direct_filebuf_t(const string &filename, size_t buffer_size)
+    : fd(-1), is_direct(false), buffer_size(buffer_size), buffer(nullptr),
+      buffer_begin(0), file_size(0) {
+  assert(buffer_size > 0 && buffer_size % direct_io_alignment == 0);
+  // We open the file for reading as well, since seeking back requires
+  // reading partially overwritten aligned pieces
+#if defined O_DIRECT
+  fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+  is_direct = fd >= 0;
+#endif
+  if (fd < 0) {
+    // The file system does not support direct I/O
+    fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+#if !defined O_DIRECT && defined F_NOCACHE
+    if (fd >= 0)
+      fcntl(fd, F_NOCACHE, 1);
+#endif
+  }
+  buffer = static_cast<char *>(
+      ::operator new(buffer_size, std::align_val_t(direct_io_alignment)));
+  setp(buffer, buffer + buffer_size);
+}
+
+direct_filebuf_t::~direct_filebuf_t() {
+  close();
+  ::operator delete(buffer, std::align_val_t(direct_io_alignment));
+}
+
+void direct_filebuf_t::read_aligned(char *buf, int64_t offset) const {
+  // Read an aligned piece; beyond the end of the file it is zero
+  const size_t nread = pread_direct(fd, reinterpret_cast<unsigned char *>(buf),
+                                    direct_io_alignment, offset);
+  memset(buf + nread, 0, direct_io_alignment - nread);
+}
+
+void direct_filebuf_t::write_buffer(size_t nbytes) {
+  // Direct I/O can only write whole aligned pieces. If the last piece is
+  // only partially filled, it is completed with the data already in the file
+  // (if any), or padded. The padding is removed when the file is closed.
+  size_t nwrite = nbytes;
+  if (is_direct) {
+    nwrite = round_up_to_alignment(nbytes);
+    if (nwrite > nbytes) {
+      const size_t tail = nwrite - direct_io_alignment;
+      if (buffer_begin + int64_t(nbytes) < file_size) {
+        aligned_buffer_t piece(direct_io_alignment);
+        char *const piece_ptr = reinterpret_cast<char *>(piece.ptr());
+        read_aligned(piece_ptr, buffer_begin + int64_t(tail));
+        memcpy(buffer + nbytes, piece_ptr + (nbytes - tail), nwrite - nbytes);
+      } else {
+        memset(buffer + nbytes, 0, nwrite - nbytes);
+      }
+    }
+  }
+  size_t nwritten = 0;
+  while (nwritten < nwrite) {
+    const ssize_t res = ::pwrite(fd, buffer + nwritten, nwrite - nwritten,
+                                 off_t(buffer_begin + int64_t(nwritten)));
+    if (res < 0 && errno == EINTR)
+      continue;
+    assert(res > 0);
+    nwritten += res;
+  }
+  buffer_begin += nbytes;
+  file_size = max(file_size, buffer_begin);
+}
+
+void direct_filebuf_t::close() {
+  if (fd < 0)
+    return;
+  const size_t used = pptr() - pbase();
+  if (used > 0)
+    write_buffer(used);
+  if (is_direct) {
+    const int ierr = ::ftruncate(fd, off_t(file_size));
+    assert(!ierr);
+  }
+  ::close(fd);
+  fd = -1;
+  // Further output fails
+  setp(buffer, buffer);
+}
+
+direct_filebuf_t::int_type direct_filebuf_t::overflow(int_type ch) {
+  if (fd < 0)
+    return traits_type::eof();
+  // Write the aligned part of the buffer, and keep the rest
+  const size_t used = pptr() - pbase();
+  const size_t nwrite =
+      is_direct ? used / direct_io_alignment * direct_io_alignment : used;
+  if (nwrite > 0) {
+    write_buffer(nwrite);
+    memmove(buffer, buffer + nwrite, used - nwrite);
+  }
+  setp(buffer, buffer + buffer_size);
+  pbump(int(used - nwrite));
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+direct_filebuf_t::pos_type direct_filebuf_t::seek_to(int64_t pos) {
+  if (fd < 0 || pos < 0)
+    return pos_type(off_type(-1));
+  const size_t used = pptr() - pbase();
+  if (used > 0)
+    write_buffer(used);
+  // Continue buffering at the beginning of the aligned piece containing `pos`
+  const int64_t aligned_pos =
+      is_direct ? pos / int64_t(direct_io_alignment) *
+                      int64_t(direct_io_alignment)
+                : pos;
+  const size_t prefix = pos - aligned_pos;
+  if (prefix > 0)
+    read_aligned(buffer, aligned_pos);
+  buffer_begin = aligned_pos;
+  setp(buffer, buffer + buffer_size);
+  pbump(int(prefix));
+  return pos_type(pos);
+}
+
+direct_filebuf_t::pos_type
+direct_filebuf_t::seekoff(off_type off, ios_base::seekdir dir,
+                          ios_base::openmode which) {
+  if (fd < 0 || !(which & ios_base::out))
+    return pos_type(off_type(-1));
+  const int64_t current = buffer_begin + int64_t(pptr() - pbase());
+  if (off == 0 && dir == ios_base::cur)
+    return pos_type(current);
+  switch (dir) {
+  case ios_base::beg:
+    return seek_to(off);
+  case ios_base::cur:
+    return seek_to(current + off);
+  case ios_base::end:
+    return seek_to(max(file_size, current) + off);
+  default:
+    return pos_type(off_type(-1));
+  }
+}
+
+direct_filebuf_t::pos_type
+direct_filebuf_t::seekpos(pos_type pos, ios_base::openmode which) {
+  if (!(which & ios_base::out))
+    return pos_type(off_type(-1));
+  return seek_to(off_type(pos));
+}
+
+#else
+
+direct_filebuf_t::direct_filebuf_t(const string &filename, size_t buffer_size)
+    : fd(-1), is_direct(false), buffer_size(buffer_size), buffer(nullptr),
+      buffer_begin(0), file_size(0) {
+  // Direct I/O is not available
+  assert(0);
+}
+
+direct_filebuf_t::~direct_filebuf_t() {}
+
+void direct_filebuf_t::read_aligned(char *buf, int64_t offset) const {
+  assert(0);
+}
+
+void direct_filebuf_t::write_buffer(size_t nbytes) { assert(0); }
+
+void direct_filebuf_t::close() {}
+
+direct_filebuf_t::int_type direct_filebuf_t::overflow(int_type ch) {
+  return traits_type::eof();
+}
+
+direct_filebuf_t::pos_type direct_filebuf_t::seek_to(int64_t pos) {
+  return pos_type(off_type(-1));
+}
+
+direct_filebuf_t::pos_type
+direct_filebuf_t::seekoff(off_type off, ios_base::seekdir dir,
+                          ios_base::openmode which) {
+  return pos_type(off_type(-1));
+}
+
+direct_filebuf_t::pos_type
+direct_filebuf_t::seekpos(pos_type pos, ios_base::openmode which) {
+  return pos_type(off_type(-1));
+}
+
+#endif
+
+// Output sinks
+
+ostream_sink_t::ostream_sink_t(ostream &os) : os(os) {
+  pos = os.tellp();
+  seekable = pos >= 0;
+  if (!seekable) {
+    os.clear();
+    pos = 0;
+  }
+}
+
+void ostream_sink_t::writev(const vector<write_buffer_t> &buffers) {
+  for (const auto &buffer : buffers) {
+    os.write(static_cast<const char *>(buffer.buf), buffer.nbytes);
+    pos += buffer.nbytes;
+  }
+  assert(os);
+}
+
+void ostream_sink_t::patch(const void *buf, size_t nbytes, int64_t offset) {
+  assert(seekable);
+  assert(offset >= 0 && offset + int64_t(nbytes) <= pos);
+  const auto end_pos = os.tellp();
+  os.seekp(offset);
+  os.write(static_cast<const char *>(buf), nbytes);
+  os.seekp(end_pos);
+  // Patching requires a seekable stream
+  assert(os);
+}
+
+void ostream_sink_t::sync() {
+  os.flush();
+  assert(os);
+}
+
+#ifdef ASDF_HAVE_PREAD
+
+fd_sink_t::fd_sink_t(const string &filename)
+    : owns_fd(true), pos(0), seekable(false) {
+  fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  // The file might be a named pipe
+  if (fd >= 0)
+    seekable = ::lseek(fd, 0, SEEK_CUR) >= 0;
+}
+
+fd_sink_t::fd_sink_t(const string &filename, int64_t pos, bool truncate)
+    : owns_fd(true), pos(pos), seekable(true) {
+  assert(pos >= 0);
+  fd = ::open(filename.c_str(), O_RDWR);
+  assert(fd >= 0);
+  if (truncate) {
+    const int ierr = ::ftruncate(fd, off_t(pos));
+    assert(!ierr);
+  }
+  const off_t res = ::lseek(fd, off_t(pos), SEEK_SET);
+  assert(res == off_t(pos));
+}
+
+fd_sink_t::fd_sink_t(int fd) : fd(fd), owns_fd(false) {
+  assert(fd >= 0);
+  pos = ::lseek(fd, 0, SEEK_CUR);
+  // Pipes and sockets have no position
+  seekable = pos >= 0;
+  if (!seekable)
+    pos = 0;
+}
+
+fd_sink_t::~fd_sink_t() {
+  if (owns_fd && fd >= 0)
+    ::close(fd);
+}
+
+void fd_sink_t::writev(const vector<write_buffer_t> &buffers) {
+  assert(fd >= 0);
+#ifdef IOV_MAX
+  const size_t max_iovcnt = IOV_MAX;
+#else
+  const size_t max_iovcnt = 1024;
+#endif
+  vector<iovec> iov;
+  iov.reserve(buffers.size());
+  for (const auto &buffer : buffers)
+    if (buffer.nbytes > 0)
+      iov.push_back({const_cast<void *>(buffer.buf), buffer.nbytes});
+  size_t first = 0;
+  while (first < iov.size()) {
+    const size_t iovcnt = min(max_iovcnt, iov.size() - first);
+    const ssize_t nbytes = ::writev(fd, &iov[first], iovcnt);
+    if (nbytes < 0 && errno == EINTR)
+      continue;
+    assert(nbytes > 0);
+    pos += nbytes;
+    // Skip the buffers that were written completely, and adjust the buffer
+    // that was written partially
+    size_t remaining = nbytes;
+    while (remaining > 0 && remaining >= iov[first].iov_len)
+      remaining -= iov[first++].iov_len;
+    if (remaining > 0) {
+      iov[first].iov_base =
+          static_cast<char *>(iov[first].iov_base) + remaining;
+      iov[first].iov_len -= remaining;
+    }
+  }
+}
+
+void fd_sink_t::patch(const void *buf, size_t nbytes, int64_t offset) {
+  assert(fd >= 0);
+  assert(seekable);
+  assert(offset >= 0 && offset + int64_t(nbytes) <= pos);
+  const char *ptr = static_cast<const char *>(buf);
+  while (nbytes > 0) {
+    const ssize_t nwritten = ::pwrite(fd, ptr, nbytes, offset);
+    if (nwritten < 0 && errno == EINTR)
+      continue;
+    assert(nwritten > 0);
+    ptr += nwritten;
+    nbytes -= nwritten;
+    offset += nwritten;
+  }
+}
+
+void fd_sink_t::sync() {
+  assert(fd >= 0);
+  // Pipes and sockets cannot be synced
+  if (!seekable)
+    return;
+  int ierr;
+  do
+    ierr = ::fsync(fd);
+  while (ierr < 0 && errno == EINTR);
+  assert(!ierr);
+}
+
+#else
+
+fd_sink_t::fd_sink_t(const string &filename)
+    : fd(-1), owns_fd(false), pos(0), seekable(false) {
+  // File descriptors are not available
+  assert(0);
+}
+
+fd_sink_t::fd_sink_t(const string &filename, int64_t pos, bool truncate)
+    : fd(-1), owns_fd(false), pos(0), seekable(false) {
+  assert(0);
+}
+
+fd_sink_t::fd_sink_t(int fd)
+    : fd(-1), owns_fd(false), pos(0), seekable(false) {
+  assert(0);
+}
+
+fd_sink_t::~fd_sink_t() {}
+
+void fd_sink_t::writev(const vector<write_buffer_t> &buffers) { assert(0); }
+
+void fd_sink_t::patch(const void *buf, size_t nbytes, int64_t offset) {
+  assert(0);
+}
+
+void fd_sink_t::sync() { assert(0); }
+
+#endif
+
+memory_sink_t::memory_sink_t(void *ptr, size_t nbytes)
+    : data(static_cast<unsigned char *>(ptr)), capacity(nbytes), size(0) {
+  assert(data || capacity == 0);
+}
+
+void memory_sink_t::writev(const vector<write_buffer_t> &buffers) {
+  for (const auto &buffer : buffers) {
+    // The memory region is too small
+    assert(buffer.nbytes <= capacity - size);
+    if (buffer.nbytes > 0)
+      std::memcpy(data + size, buffer.buf, buffer.nbytes);
+    size += buffer.nbytes;
+  }
+}
+
+void memory_sink_t::patch(const void *buf, size_t nbytes, int64_t offset) {
+  assert(offset >= 0 && size_t(offset) + nbytes <= size);
+  if (nbytes > 0)
+    std::memcpy(data + offset, buf, nbytes);
+}
+
+void counting_sink_t::writev(const vector<write_buffer_t> &buffers) {
+  for (const auto &buffer : buffers)
+    size += buffer.nbytes;
+}
+
+void counting_sink_t::patch(const void *buf, size_t nbytes, int64_t offset) {
+  assert(offset >= 0 && size_t(offset) + nbytes <= size);
+}
+
+#ifndef ASDF_HAVE_PREAD
+namespace {
+class ofstream_sink_t : public output_sink_t {
+  ofstream os;
+  ostream_sink_t sink;
+
+public:
+  ofstream_sink_t(const string &filename)
+      : os(filename, ios::binary | ios::trunc | ios::out), sink(os) {}
+  virtual ~ofstream_sink_t() {}
+
+  virtual void writev(const vector<write_buffer_t> &buffers) override {
+    sink.writev(buffers);
+  }
+  virtual int64_t tell() const override { return sink.tell(); }
+  virtual bool is_seekable() const override { return sink.is_seekable(); }
+  virtual void patch(const void *buf, size_t nbytes, int64_t offset) override {
+    sink.patch(buf, nbytes, offset);
+  }
+  virtual void sync() override { sink.sync(); }
+};
+} // namespace
+#endif
+
+unique_ptr<output_sink_t> open_output_sink(const string &filename) {
+#ifdef ASDF_HAVE_PREAD
+  return make_unique<fd_sink_t>(filename);
+#else
+  return make_unique<ofstream_sink_t>(filename);
+#endif
+}
+
+} // namespace ASDF
@@ -5,8 +5,16 @@
 
 #include <yaml-cpp/yaml.h>
 
+#include <algorithm>
+#include <array>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
 
 namespace ASDF {
 
@@ -77,6 +85,14 @@ bool have_compression_zlib() {
 #endif
 }
 
+bool have_io_uring() {
+#ifdef ASDF_HAVE_LIBURING
+  return true;
+#else
+  return false;
+#endif
+}
+
 // I/O
 
 std::ostream &operator<<(std::ostream &os, block_format_t block_format) {
@@ -111,22 +127,333 @@ std::ostream &operator<<(std::ostream &os, compression_t compression) {
   }
 }
 
+namespace {
+// Bytes that may pad the space between the tree and the first block
+bool is_padding(int ch) {
+  return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\0';
+}
+
+int64_t skip_padding(const random_access_file_t &file, int64_t pos) {
+  array<unsigned char, 4096> buf;
+  for (;;) {
+    const size_t nread = file.read_some(buf.data(), buf.size(), pos);
+    size_t n = 0;
+    while (n < nread && is_padding(buf[n]))
+      ++n;
+    pos += n;
+    if (n < buf.size())
+      return pos;
+  }
+}
+} // namespace
+
 reader_state::reader_state(const YAML::Node &tree,
                            const shared_ptr<istream> &pis,
-                           const string &filename)
-    : tree(tree), filename(filename) {
+                           const string &filename,
+                           const reader_options &options)
+    : reader_state(tree, make_shared<istream_file_t>(pis),
+                   int64_t(pis->tellg()), filename, options) {}
+
+shared_ptr<reader_state> reader_state::open(const string &filename,
+                                            const reader_options &options) {
+  ifstream is(filename, ios::binary | ios::in);
+  assert(is);
+  const auto tree = asdf::from_yaml(is);
+  const int64_t pos = is.tellg();
+  return make_shared<reader_state>(
+      tree, open_random_access_file(filename, options.direct_io), pos,
+      filename, options);
+}
+
+reader_state::reader_state(const YAML::Node &tree,
+                           const shared_ptr<random_access_file_t> &file,
+                           int64_t pos, const string &filename,
+                           const reader_options &options)
+    : tree(tree), options(options), filename(filename), file(file),
+      blocks(make_shared<block_table_t>()) {
+  assert(pos >= 0);
+  assert(!options.sequential);
+  if (!this->options.allocator)
+    this->options.allocator = get_default_block_allocator();
+  blocks->scan_pos = pos;
+  if (!options.tree_only) {
+    lock_guard<mutex> lock(blocks->mtx);
+    blocks->discover(file);
+  }
+}
+
+reader_state::reader_state(const YAML::Node &tree, istream &is,
+                           const reader_options &options)
+    : tree(tree), options(options), blocks(make_shared<block_table_t>()) {
+  assert(!options.tree_only);
+  if (!this->options.allocator)
+    this->options.allocator = get_default_block_allocator();
+  const auto &block_callback = this->options.block_callback;
+  // Pipes have no position; block positions then count from the first block
+  int64_t pos = is.tellg();
+  if (pos < 0) {
+    is.clear();
+    pos = 0;
+  }
+  while (is_padding(is.peek())) {
+    is.get();
+    ++pos;
+  }
+  is.clear();
   for (;;) {
-    const auto [block, block_info] = ndarray::read_block(pis);
-    if (!block.valid())
+    const auto [data, block_info] = ndarray::read_block_sequential(
+        is, pos, this->options.allocator);
+    if (!data)
       break;
-    blocks.push_back(std::move(block));
-    block_infos.push_back(std::move(block_info));
+    const int64_t index = blocks->positions.size();
+    blocks->add_block(block_info);
+    // There is no file to read the block headers from later
+    blocks->infos[index] = make_shared<block_info_t>(block_info);
+    auto &block = blocks->data[index];
+    if (block_callback) {
+      block_callback(index, data);
+      block = memoized<block_t>([]() {
+        // The data were handed to the block callback
+        assert(0);
+        return shared_ptr<block_t>();
+      });
+    } else {
+      block = memoized<block_t>([data]() { return data; });
+      block.make_ready();
+    }
   }
 }
 
+void reader_state::block_table_t::add_block(const block_info_t &block_info) {
+  positions.push_back(block_info.data_begin - 6 - block_info.header_size);
+  header_sizes.push_back(block_info.header_size);
+  flags.push_back(block_info.flags);
+  allocated_spaces.push_back(block_info.allocated_space);
+}
+
+void reader_state::block_table_t::discover(
+    const shared_ptr<random_access_file_t> &file) {
+  if (scan_pos < 0)
+    return;
+  int64_t pos = skip_padding(*file, scan_pos);
+  for (;;) {
+    const auto block_info = ndarray::read_block_info(file, pos);
+    if (!block_info)
+      break;
+    add_block(*block_info);
+  }
+  scan_pos = -1;
+}
+
+shared_ptr<const block_info_t> reader_state::block_table_t::get_info(
+    const shared_ptr<random_access_file_t> &file, int64_t index) {
+  assert(index >= 0 && index < int64_t(positions.size()));
+  auto &block_info = infos[index];
+  if (!block_info) {
+    // In sequential mode, all block headers are kept
+    assert(file);
+    int64_t pos = positions.at(index);
+    const auto info = ndarray::read_block_info(file, pos);
+    assert(info);
+    assert(info->data_begin ==
+           positions.at(index) + 6 + header_sizes.at(index));
+    block_info = make_shared<block_info_t>(*info);
+  }
+  return block_info;
+}
+
+const reader_state::block_table_t &reader_state::get_blocks() const {
+  lock_guard<mutex> lock(blocks->mtx);
+  blocks->discover(file);
+  return *blocks;
+}
+
+shared_ptr<const block_info_t>
+reader_state::get_block_info_ptr(int64_t index) const {
+  lock_guard<mutex> lock(blocks->mtx);
+  blocks->discover(file);
+  return blocks->get_info(file, index);
+}
+
 block_info_t reader_state::get_block_info(int64_t index) const {
+  return *get_block_info_ptr(index);
+}
+
+memoized<block_t> reader_state::get_block(int64_t index) const {
   assert(index >= 0);
-  return block_infos.at(index);
+  lock_guard<mutex> lock(blocks->mtx);
+  auto &block = blocks->data[index];
+  if (!block.valid()) {
+    // Neither the blocks nor the block header need to be read yet
+    const shared_ptr<block_table_t> table = blocks;
+    const shared_ptr<random_access_file_t> file = this->file;
+    const shared_ptr<block_allocator_t> allocator = options.allocator;
+    block = memoized<block_t>([=]() {
+      shared_ptr<const block_info_t> block_info;
+      {
+        lock_guard<mutex> lock(table->mtx);
+        table->discover(file);
+        block_info = table->get_info(file, index);
+      }
+      return ndarray::make_block_data(file, *block_info, allocator).get();
+    });
+  }
+  return block;
+}
+
+void reader_state::load_blocks(const vector<int64_t> &indices,
+                               const load_options &load_opts) const {
+  vector<int64_t> todo;
+  for (const int64_t index : indices) {
+    assert(index >= 0);
+    if (!get_block(index).ready())
+      todo.push_back(index);
+  }
+  if (todo.empty())
+    return;
+  // In sequential mode, the data of all blocks are either held or gone
+  assert(file);
+  // Read in file order
+  const auto &positions = get_blocks().positions;
+  sort(todo.begin(), todo.end(), [&](int64_t i, int64_t j) {
+    return positions.at(i) < positions.at(j);
+  });
+  todo.erase(unique(todo.begin(), todo.end()), todo.end());
+
+  // The block headers and data of the blocks to be loaded
+  vector<shared_ptr<const block_info_t>> block_infos(todo.size());
+  vector<memoized<block_t>> blocks(todo.size());
+  for (size_t n = 0; n < todo.size(); ++n) {
+    block_infos[n] = get_block_info_ptr(todo[n]);
+    blocks[n] = get_block(todo[n]);
+  }
+
+  // Blocks in files held in memory are not read at all
+  const auto &allocator = options.allocator;
+  vector<shared_ptr<block_t>> inblocks(todo.size());
+  vector<bool> mapped(todo.size());
+  for (size_t n = 0; n < todo.size(); ++n) {
+    const auto &block_info = *block_infos[n];
+    if (const void *ptr =
+            file->map(block_info.data_begin, block_info.used_space)) {
+      inblocks[n] =
+          make_shared<view_block_t>(ptr, block_info.used_space, file);
+      mapped[n] = true;
+    } else {
+      inblocks[n] = ndarray::make_input_block(block_info, allocator);
+    }
+  }
+
+  // Merge blocks that are close to each other into extents, which are read
+  // with a single request each. Blocks that are read on their own are read
+  // directly into their input block; otherwise the extent is read into a
+  // temporary buffer and then split.
+  struct extent_t {
+    int64_t begin, end;
+    size_t first, last; // range of blocks in `todo`
+    bool mapped;
+    shared_ptr<block_t> buffer;
+  };
+  vector<extent_t> extents;
+  for (size_t n = 0; n < todo.size(); ++n) {
+    const auto &block_info = *block_infos[n];
+    const int64_t begin = block_info.data_begin;
+    const int64_t end = begin + int64_t(block_info.used_space);
+    if (!extents.empty() && !mapped[n]) {
+      auto &extent = extents.back();
+      if (!extent.mapped && begin - extent.end <= load_opts.max_gap &&
+          end - extent.begin <= load_opts.max_extent_size) {
+        extent.end = end;
+        extent.last = n + 1;
+        continue;
+      }
+    }
+    extents.push_back({begin, end, n, n + 1, bool(mapped[n]), {}});
+  }
+
+  vector<read_request_t> requests;
+  vector<size_t> request_extents;
+  for (size_t e = 0; e < extents.size(); ++e) {
+    auto &extent = extents[e];
+    if (extent.mapped)
+      continue;
+    if (extent.last - extent.first == 1) {
+      const auto &inblock = inblocks[extent.first];
+      requests.push_back({inblock->ptr(), inblock->nbytes(), extent.begin});
+    } else {
+      extent.buffer = make_shared<typed_block_t<unsigned char>>(
+          vector<unsigned char>(extent.end - extent.begin));
+      requests.push_back({extent.buffer->ptr(), extent.buffer->nbytes(),
+                          extent.begin});
+    }
+    request_extents.push_back(e);
+    if (load_opts.readahead)
+      file->will_need(extent.begin, extent.end - extent.begin);
+  }
+
+  // Decompress blocks on worker threads while the remaining reads are still
+  // in flight
+  mutex mtx;
+  condition_variable cv;
+  deque<size_t> completed;
+  for (size_t e = 0; e < extents.size(); ++e)
+    if (extents[e].mapped)
+      completed.push_back(e);
+  bool all_read = false;
+  const auto decode = [&]() {
+    for (;;) {
+      size_t e;
+      {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [&]() { return !completed.empty() || all_read; });
+        if (completed.empty())
+          return;
+        e = completed.front();
+        completed.pop_front();
+      }
+      auto &extent = extents[e];
+      for (size_t n = extent.first; n < extent.last; ++n) {
+        const auto &block_info = *block_infos[n];
+        if (extent.buffer)
+          memcpy(inblocks[n]->ptr(),
+                 static_cast<const unsigned char *>(extent.buffer->ptr()) +
+                     (block_info.data_begin - extent.begin),
+                 inblocks[n]->nbytes());
+        blocks[n].set(
+            ndarray::decode_block(inblocks[n], block_info, allocator));
+        inblocks[n].reset();
+      }
+      extent.buffer.reset();
+    }
+  };
+  const size_t nthreads =
+      min(extents.size(), size_t(max(1U, thread::hardware_concurrency())));
+  vector<thread> workers;
+  for (size_t t = 0; t < nthreads; ++t)
+    workers.emplace_back(decode);
+
+  file->read_batch(requests, [&](size_t r) {
+    {
+      lock_guard<mutex> lock(mtx);
+      completed.push_back(request_extents[r]);
+    }
+    cv.notify_one();
+  });
+
+  {
+    lock_guard<mutex> lock(mtx);
+    all_read = true;
+  }
+  cv.notify_all();
+  for (auto &worker : workers)
+    worker.join();
+}
+
+void reader_state::load_all_blocks(const load_options &load_opts) const {
+  vector<int64_t> indices(get_block_count());
+  for (size_t n = 0; n < indices.size(); ++n)
+    indices[n] = n;
+  load_blocks(indices, load_opts);
 }
 
 YAML::Node reader_state::resolve_reference(const vector<string> &path) const {
@@ -181,12 +508,8 @@ reader_state::resolve_reference(const shared_ptr<reader_state> &rs,
       else
         ref_filename = rs->filename.substr(0, slashpos + 1) + filename;
     }
-    if (!rs->other_files.count(ref_filename)) {
-      auto pis = make_shared<ifstream>(ref_filename, ios::binary | ios::in);
-      auto doc = asdf::from_yaml((istream &)*pis);
-      rs->other_files[ref_filename] =
-          make_shared<reader_state>(doc, pis, ref_filename);
-    }
+    if (!rs->other_files.count(ref_filename))
+      rs->other_files[ref_filename] = open(ref_filename, rs->options);
     refrs = rs->other_files.at(ref_filename);
   }
 
@@ -194,39 +517,177 @@ reader_state::resolve_reference(const shared_ptr<reader_state> &rs,
   return make_pair(refrs, node);
 }
 
-writer::writer(ostream &os, const map<string, string> &tags)
-    : os(os), emitter(os) {
+writer::writer(output_sink_t &sink, const map<string, string> &tags,
+               const writer_options &options)
+    : sink(sink), tree_done(false), tree_padding(options.tree_padding),
+      block_slack(options.block_slack),
+      deduplicate_blocks(options.deduplicate_blocks),
+      pack_threshold(options.pack_threshold),
+      pack_block_size(options.pack_block_size) {
+  begin(tags);
+}
+
+writer::writer(ostream &os, const map<string, string> &tags,
+               const writer_options &options)
+    : own_sink(make_unique<ostream_sink_t>(os)), sink(*own_sink),
+      tree_done(false), tree_padding(options.tree_padding),
+      block_slack(options.block_slack),
+      deduplicate_blocks(options.deduplicate_blocks),
+      pack_threshold(options.pack_threshold),
+      pack_block_size(options.pack_block_size) {
+  begin(tags);
+}
+
+writer::writer(output_sink_t &sink, const map<string, string> &tags,
+               existing_blocks_t existing1, const writer_options &options)
+    : sink(sink), tree_done(false), tree_padding(0),
+      block_slack(options.block_slack),
+      deduplicate_blocks(options.deduplicate_blocks),
+      pack_threshold(options.pack_threshold),
+      pack_block_size(options.pack_block_size),
+      existing(std::move(existing1)) {
+  assert(!existing.filename.empty());
+  begin(tags);
+}
+
+void writer::begin(const map<string, string> &tags) {
+  // The tree is collected in memory and handed to the sink in one piece
+  ostringstream buf;
   // yaml-cpp does not support comments without leading space
-  os << "#ASDF " << asdf_format_version << "\n"
-     << "#ASDF_STANDARD " << asdf_standard_version() << "\n"
-     << "# This is an ASDF file <https://asdf-standard.readthedocs.io/>\n"
-     // yaml-cpp does not support writing a YAML tag
-     << "%YAML 1.1\n"
-     << "%TAG ! tag:stsci.edu:asdf/\n";
+  buf << "#ASDF " << asdf_format_version << "\n"
+      << "#ASDF_STANDARD " << asdf_standard_version() << "\n"
+      << "# This is an ASDF file <https://asdf-standard.readthedocs.io/>\n"
+      // yaml-cpp does not support writing a YAML tag
+      << "%YAML 1.1\n"
+      << "%TAG ! tag:stsci.edu:asdf/\n";
   for (const auto &kv : tags)
-    os << "%TAG !" << kv.first << "! " << kv.second << "\n";
+    buf << "%TAG !" << kv.first << "! " << kv.second << "\n";
+  preamble = buf.str();
   emitter << YAML::BeginDoc;
 }
 
-writer::~writer() { assert(tasks.empty()); }
+writer::~writer() { assert(tasks.empty() && !streamed_task); }
+
+int64_t writer::get_existing_block(const reader_state &rs,
+                                   int64_t source) const {
+  if (!same_file(rs.get_filename(), existing.filename))
+    return -1;
+  return existing.indices.at(source);
+}
+
+pair<int64_t, int64_t>
+writer::find_block(const string &key,
+                   const function<bool(const ndarray &arr)> &same) const {
+  const auto range = block_keys.equal_range(key);
+  for (auto iter = range.first; iter != range.second; ++iter)
+    if (same(*iter->second.arr))
+      return {iter->second.idx, iter->second.offset};
+  return {-1, 0};
+}
+
+pair<int64_t, int64_t> writer::add_to_pack(
+    const string &pack_key, int64_t nbytes, shared_ptr<const ndarray> arr,
+    const function<function<void(output_sink_t &sink)>(
+        const shared_ptr<const block_pack_t> &pack)> &make_task) {
+  assert(nbytes >= 0 && nbytes <= pack_threshold);
+  // Align the data suitably for all scalar types
+  const int64_t alignment = 16;
+  auto iter = packs.find(pack_key);
+  if (iter != packs.end()) {
+    const int64_t offset =
+        (iter->second.second->nbytes + alignment - 1) / alignment * alignment;
+    if (offset + nbytes > pack_block_size)
+      iter = packs.end(); // start a new shared block
+  }
+  if (iter == packs.end()) {
+    const auto pack = make_shared<block_pack_t>();
+    const int64_t idx = add_task(make_task(pack));
+    iter = packs.insert_or_assign(pack_key, make_pair(idx, pack)).first;
+  }
+  const int64_t idx = iter->second.first;
+  block_pack_t &pack = *iter->second.second;
+  const int64_t offset = (pack.nbytes + alignment - 1) / alignment * alignment;
+  pack.arrays.push_back({offset, std::move(arr)});
+  pack.nbytes = offset + nbytes;
+  return {idx, offset};
+}
+
+const string &writer::get_tree() {
+  if (!tree_done) {
+    emitter << YAML::EndDoc;
+    tree = preamble + emitter.c_str();
+    tree_done = true;
+  }
+  return tree;
+}
+
+void writer::discard() {
+  block_keys.clear();
+  packs.clear();
+  tasks.clear();
+  streamed_task = nullptr;
+}
 
 void writer::flush() {
-  emitter << YAML::EndDoc;
-  if (!tasks.empty()) {
+  get_tree();
+  const bool appending = !existing.filename.empty();
+  if (!appending) {
+    assert(tree_padding >= 0);
+    const string padding =
+        tree_padding == 0 ? string() : string(tree_padding - 1, ' ') + "\n";
+    sink.writev({{tree.data(), tree.size()},
+                 {padding.data(), padding.size()}});
+  }
+  if (streamed_task) {
+    // A file with a streamed block has no block index
+    assert(!appending);
+    for (auto &&task : tasks)
+      std::move(task)(sink);
+    tasks.clear();
+    std::move(streamed_task)(sink);
+    streamed_task = nullptr;
+  } else if (!tasks.empty() || !existing.positions.empty()) {
     YAML::Emitter index;
     index << YAML::BeginDoc << YAML::Flow << YAML::BeginSeq;
+    for (const int64_t pos : existing.positions)
+      index << pos;
     for (auto &&task : tasks) {
-      index << os.tellp();
-      std::move(task)(os);
+      index << sink.tell();
+      std::move(task)(sink);
     }
     tasks.clear();
     index << YAML::EndSeq << YAML::EndDoc;
     // yaml-cpp does not support comments without leading space
-    os << "#ASDF BLOCK INDEX\n"
-       // yaml-cpp does not support writing a YAML tag
-       << "%YAML 1.1\n"
-       << index.c_str();
+    // yaml-cpp does not support writing a YAML tag
+    const string index_header = "#ASDF BLOCK INDEX\n%YAML 1.1\n";
+    sink.writev({{index_header.data(), index_header.size()},
+                 {index.c_str(), index.size()}});
   }
 }
 
+streamed_block_appender_t::streamed_block_appender_t(const string &filename) {
+  {
+    // Check that the file ends with a streamed block
+    const auto pis = make_shared<ifstream>(filename, ios::binary | ios::in);
+    assert(*pis);
+    const auto node = asdf::from_yaml(*pis);
+    const reader_state rs(node, pis, filename);
+    const int64_t nblocks = rs.get_block_count();
+    assert(nblocks > 0);
+    assert(rs.get_block_flags(nblocks - 1) & block_flag_streamed);
+  }
+  os.open(filename, ios::binary | ios::app | ios::out);
+  assert(os);
+}
+
+void streamed_block_appender_t::append(const void *buf, size_t nbytes) {
+  os.write(static_cast<const char *>(buf), nbytes);
+  assert(os);
+}
+
+void streamed_block_appender_t::flush() {
+  os.flush();
+  assert(os);
+}
+
 } // namespace ASDF
@@ -33,8 +33,14 @@
 #endif
 
 #include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string_view>
 #include <type_traits>
 
 namespace ASDF {
@@ -47,14 +53,100 @@ typed_block_t<bool>::typed_block_t(const vector<bool> &data) {
     this->data[i] = data[i];
 }
 
+allocated_block_t::allocated_block_t(shared_ptr<block_allocator_t> allocator1,
+                                     size_t nbytes)
+    : allocator(std::move(allocator1)), data(nullptr), size(0), capacity(0) {
+  assert(allocator);
+  resize(nbytes);
+}
+
+allocated_block_t::~allocated_block_t() {
+  if (data)
+    allocator->deallocate(data, capacity);
+}
+
+void allocated_block_t::reserve(size_t nbytes) {
+  if (nbytes <= capacity)
+    return;
+  void *newdata = allocator->allocate(nbytes);
+  if (data) {
+    std::memcpy(newdata, data, size);
+    allocator->deallocate(data, capacity);
+  }
+  data = newdata;
+  capacity = nbytes;
+}
+
+void allocated_block_t::resize(size_t nbytes) {
+  reserve(nbytes);
+  size = nbytes;
+}
+
+template <typename T>
+void append_value(vector<unsigned char> &data, const T &value) {
+  const size_t oldsize = data.size();
+  data.resize(oldsize + sizeof value);
+  std::memcpy(&data[oldsize], &value, sizeof value);
+}
+
+// Convert the values of type `T` in `data` to the wider type `U` in place
+template <typename T, typename U>
+void widen_values(vector<unsigned char> &data) {
+  static_assert(sizeof(U) >= sizeof(T), "");
+  const size_t count = data.size() / sizeof(T);
+  data.resize(count * sizeof(U));
+  // Convert back to front so that no value is overwritten before it is read
+  for (size_t i = count; i-- > 0;) {
+    T value;
+    std::memcpy(&value, &data[i * sizeof(T)], sizeof value);
+    const U wide_value(value);
+    std::memcpy(&data[i * sizeof(U)], &wide_value, sizeof wide_value);
+  }
+}
+
+// Append a scalar while inferring the datatype: int64 while all values are
+// integers, then float64, then complex128. The values already parsed are
+// widened when the datatype changes.
+void parse_inferred_scalar(const YAML::Node &node,
+                           shared_ptr<datatype_t> &datatype,
+                           vector<unsigned char> &data) {
+  const string &str = node.Scalar();
+  if (datatype->scalar_type_id == id_int64) {
+    if (const optional<int64_t> value = parse_yaml_int(str)) {
+      append_value(data, *value);
+      return;
+    }
+    widen_values<int64_t, float64_t>(data);
+    datatype = make_shared<datatype_t>(id_float64);
+  }
+  if (datatype->scalar_type_id == id_float64) {
+    if (const optional<float64_t> value = parse_yaml_float(str)) {
+      append_value(data, *value);
+      return;
+    }
+    widen_values<float64_t, complex128_t>(data);
+    datatype = make_shared<datatype_t>(id_complex128);
+  }
+  // bool8_t and ucs4_t are not inferred
+  assert(datatype->scalar_type_id == id_complex128);
+  complex128_t value;
+  yaml_decode(node, value);
+  append_value(data, value);
+}
+
 void parse_inline_array_nd(const YAML::Node &node,
-                           const shared_ptr<datatype_t> &datatype,
+                           shared_ptr<datatype_t> &datatype,
+                           const bool infer_datatype,
                            const vector<int64_t> &shape, int rank,
                            vector<unsigned char> &data) {
   assert(rank >= 0);
-  assert(shape.size() >= rank);
+  assert(shape.size() >= size_t(rank));
   if (rank == 0) {
     assert(node.IsScalar());
+    if (infer_datatype) {
+      parse_inferred_scalar(node, datatype, data);
+      return;
+    }
     size_t oldsize = data.size();
     data.resize(oldsize + datatype->type_size());
     parse_scalar(node, &data[oldsize], datatype);
@@ -62,9 +154,10 @@ void parse_inline_array_nd(const YAML::Node &node,
   }
   int64_t size = shape.at(shape.size() - rank);
   assert(node.IsSequence());
-  assert(node.size() == size);
+  assert(int64_t(node.size()) == size);
   for (YAML::const_iterator ni = node.begin(), ne = node.end(); ni != ne; ++ni)
-    parse_inline_array_nd(*ni, datatype, shape, rank - 1, data);
+    parse_inline_array_nd(*ni, datatype, infer_datatype, shape, rank - 1,
+                          data);
 }
 
 void parse_inline_array(const YAML::Node &node, shared_ptr<block_t> &data,
@@ -76,11 +169,12 @@ void parse_inline_array(const YAML::Node &node, shared_ptr<block_t> &data,
     shape.clear();
     YAML::Node n = node;
     while (n.IsSequence()) {
-      shape.insert(shape.begin(), n.size());
+      shape.push_back(n.size());
       // This method does not work if the array size is zero in one dimension
-      if (shape[0] == 0)
+      if (shape.back() == 0)
         break;
-      n = n[0];
+      // Assigning would overwrite the node's content
+      n.reset(n[0]);
     }
     assert(n.IsScalar());
   }
@@ -89,32 +183,14 @@ void parse_inline_array(const YAML::Node &node, shared_ptr<block_t> &data,
     npoints *= shape[d];
   vector<unsigned char> data1;
   if (!have_datatype) {
-    // determine datatype while parsing
-    try {
-      datatype = make_shared<datatype_t>(id_int64);
-      data1.reserve(npoints * datatype->type_size());
-      parse_inline_array_nd(node, datatype, shape, shape.size(), data1);
-    } catch (YAML::RepresentationException) {
-      try {
-        datatype = make_shared<datatype_t>(id_float64);
-        data1.reserve(npoints * datatype->type_size());
-        parse_inline_array_nd(node, datatype, shape, shape.size(), data1);
-      } catch (YAML::RepresentationException) {
-        try {
-          datatype = make_shared<datatype_t>(id_complex128);
-          data1.reserve(npoints * datatype->type_size());
-          parse_inline_array_nd(node, datatype, shape, shape.size(), data1);
-        } catch (YAML::RepresentationException) {
-          // bool8_t
-          // ucs4_t
-          assert(0);
-        }
-      }
-    }
+    // determine datatype while parsing, starting with the narrowest type
+    datatype = make_shared<datatype_t>(id_int64);
+    data1.reserve(npoints * datatype->type_size());
+    parse_inline_array_nd(node, datatype, true, shape, shape.size(), data1);
   } else {
     // parse data, expecting a particular datatype
     data1.reserve(npoints * datatype->type_size());
-    parse_inline_array_nd(node, datatype, shape, shape.size(), data1);
+    parse_inline_array_nd(node, datatype, false, shape, shape.size(), data1);
   }
   data = make_shared<typed_block_t<unsigned char>>(std::move(data1));
 }
@@ -161,30 +237,37 @@ YAML::Node emit_inline_array(const unsigned char *data,
 // one)
 constexpr array<unsigned char, 4> block_magic_token{0xd3, 0x42, 0x4c, 0x4b};
 
-template <typename T> void input(istream &is, T &data) {
+template <typename T> void input(const unsigned char *&header, T &data) {
   // Always input in big-endian as required for the header
   static_assert(std::is_integral<T>::value, "");
   using U = typename std::make_unsigned<T>::type;
   data = 0;
-  for (ptrdiff_t i = sizeof(T) - 1; i >= 0; --i) {
-    unsigned char ch;
-    is.read(reinterpret_cast<char *>(&ch), 1);
-    data = (U(data) << 8) | ch;
-  }
+  for (ptrdiff_t i = sizeof(T) - 1; i >= 0; --i)
+    data = (U(data) << 8) | *header++;
 }
 
 shared_ptr<block_t>
-read_block_data(const shared_ptr<istream> &pis, streamoff block_begin,
-                uint64_t allocated_space, uint64_t data_space,
-                compression_t compression,
-                const array<unsigned char, 16> &want_checksum) {
-  istream &is = *pis;
-  assert(is);
-  is.seekg(block_begin);
-  assert(is);
-  vector<unsigned char> indata(allocated_space);
-  is.read(reinterpret_cast<char *>(indata.data()), indata.size());
-  assert(is);
+ndarray::make_input_block(const block_info_t &block_info,
+                          const shared_ptr<block_allocator_t> &allocator) {
+  // Uncompressed data are read directly into the output block
+  if (block_info.compression == compression_t::none)
+    return make_shared<allocated_block_t>(allocator, block_info.used_space);
+  return make_shared<typed_block_t<unsigned char>>(
+      vector<unsigned char>(block_info.used_space));
+}
+
+shared_ptr<block_t>
+ndarray::decode_block(const shared_ptr<block_t> &inblock,
+                      const block_info_t &block_info,
+                      const shared_ptr<block_allocator_t> &allocator) {
+  const compression_t compression = block_info.compression;
+  const uint64_t used_space = block_info.used_space;
+  const uint64_t data_space = block_info.data_space;
+  const array<unsigned char, 16> &want_checksum = block_info.checksum;
+  assert(inblock->nbytes() == used_space);
+  const auto *const indata_ptr =
+      static_cast<const unsigned char *>(inblock->ptr());
+  const size_t indata_size = inblock->nbytes();
 
   // check checksum
 #ifdef ASDF_HAVE_OPENSSL
@@ -195,7 +278,7 @@ read_block_data(const shared_ptr<istream> &pis, streamoff block_begin,
     assert(mdctx);
     int ires = EVP_DigestInit_ex(mdctx, EVP_md5(), NULL);
     assert(ires == 1);
-    ires = EVP_DigestUpdate(mdctx, indata.data(), indata.size());
+    ires = EVP_DigestUpdate(mdctx, indata_ptr, indata_size);
     assert(ires == 1);
     assert(EVP_MD_size(EVP_md5()) == checksum.size());
     unsigned int digest_size;
@@ -208,23 +291,23 @@ read_block_data(const shared_ptr<istream> &pis, streamoff block_begin,
 #endif
 
   // decompress data
-  vector<unsigned char> data;
+  if (compression == compression_t::none) {
+    assert(data_space == used_space);
+    return inblock;
+  }
+  const auto data = make_shared<allocated_block_t>(allocator, data_space);
+  unsigned char *const data_ptr = static_cast<unsigned char *>(data->ptr());
+  const size_t data_size = data->nbytes();
   switch (compression) {
 
-  case compression_t::none:
-    assert(data_space == allocated_space);
-    data = std::move(indata);
-    break;
-
 #ifdef ASDF_HAVE_BLOSC
   case compression_t::blosc: {
     const int numinternalthreads = 1;
-    data.resize(data_space);
-    assert(data.size() <= size_t(INT_MAX));
-    int dsize = blosc_decompress_ctx(indata.data(), data.data(), data.size(),
+    assert(data_size <= size_t(INT_MAX));
+    int dsize = blosc_decompress_ctx(indata_ptr, data_ptr, data_size,
                                      numinternalthreads);
     assert(dsize > 0);
-    assert(dsize == data.size());
+    assert(dsize == data_size);
     break;
   }
 #endif
@@ -234,11 +317,11 @@ read_block_data(const shared_ptr<istream> &pis, streamoff block_begin,
     blosc2_storage storage = BLOSC2_STORAGE_DEFAULTS;
     // TODO: Don't copy the data
     blosc2_schunk *const schunk =
-        blosc2_schunk_from_buffer(indata.data(), indata.size(), false);
+        blosc2_schunk_from_buffer(const_cast<uint8_t *>(indata_ptr),
+                                  indata_size, false);
     blosc2_schunk_avoid_cframe_free(schunk, true);
-    data.resize(data_space);
-    uint8_t *output_ptr = data.data();
-    int64_t total_output_size = data.size();
+    uint8_t *output_ptr = data_ptr;
+    int64_t total_output_size = data_size;
     for (int chunk = 0; chunk < schunk->nchunks; ++chunk) {
       using std::min;
       const int output_size = blosc2_schunk_decompress_chunk(
@@ -256,17 +339,16 @@ read_block_data(const shared_ptr<istream> &pis, streamoff block_begin,
 
 #ifdef ASDF_HAVE_BZIP2
   case compression_t::bzip2: {
-    data.resize(data_space);
     bz_stream strm;
     strm.bzalloc = NULL;
     strm.bzfree = NULL;
     strm.opaque = NULL;
     BZ2_bzDecompressInit(&strm, 0, 0);
     strm.next_in =
-        reinterpret_cast<char *>(const_cast<unsigned char *>(indata.data()));
-    strm.next_out = reinterpret_cast<char *>(data.data());
-    uint64_t avail_in = indata.size();
-    uint64_t avail_out = data.size();
+        reinterpret_cast<char *>(const_cast<unsigned char *>(indata_ptr));
+    strm.next_out = reinterpret_cast<char *>(data_ptr);
+    uint64_t avail_in = indata_size;
+    uint64_t avail_out = data_size;
     for (;;) {
       uint64_t this_avail_in =
           min(uint64_t(numeric_limits<unsigned int>::max()), avail_in);
@@ -290,7 +372,6 @@ read_block_data(const shared_ptr<istream> &pis, streamoff block_begin,
 
 #ifdef ASDF_HAVE_LIBLZ4
   case compression_t::liblz4: {
-    data.resize(data_space);
 
     LZ4F_decompressOptions_t dOpt;
     std::memset(&dOpt, 0, sizeof dOpt);
@@ -307,10 +388,10 @@ read_block_data(const shared_ptr<istream> &pis, streamoff block_begin,
     assert(!LZ4F_isError(ierr));
     assert(dctx);
 
-    size_t dstSize = data.size();
-    size_t srcSize = indata.size();
+    size_t dstSize = data_size;
+    size_t srcSize = indata_size;
     const std::size_t nbytes_expected = LZ4F_decompress(
-        dctx, data.data(), &dstSize, indata.data(), &srcSize, &dOpt);
+        dctx, data_ptr, &dstSize, indata_ptr, &srcSize, &dOpt);
     assert(nbytes_expected == 0);
 
     ierr = LZ4F_freeDecompressionContext(dctx);
@@ -321,16 +402,15 @@ read_block_data(const shared_ptr<istream> &pis, streamoff block_begin,
 
 #ifdef ASDF_HAVE_ZLIB
   case compression_t::zlib: {
-    data.resize(data_space);
     z_stream strm;
     strm.zalloc = NULL;
     strm.zfree = NULL;
     strm.opaque = NULL;
     inflateInit(&strm);
-    strm.next_in = const_cast<unsigned char *>(indata.data());
-    strm.next_out = data.data();
-    uint64_t avail_in = indata.size();
-    uint64_t avail_out = data.size();
+    strm.next_in = const_cast<unsigned char *>(indata_ptr);
+    strm.next_out = data_ptr;
+    uint64_t avail_in = indata_size;
+    uint64_t avail_out = data_size;
     for (;;) {
       uint64_t this_avail_in =
           min(uint64_t(numeric_limits<unsigned int>::max()), avail_in);
@@ -356,32 +436,42 @@ read_block_data(const shared_ptr<istream> &pis, streamoff block_begin,
     assert(0);
   }
 
-  return make_shared<typed_block_t<unsigned char>>(std::move(data));
+  return data;
 }
 
-std::tuple<memoized<block_t>, block_info_t>
-ndarray::read_block(const shared_ptr<istream> &pis) {
-  istream &is = *pis;
-  // block_magic_token
-  array<unsigned char, 4> token;
-  for (auto &ch : token)
-    input(is, ch);
-  if (token != block_magic_token) {
-    is.seekg(-int64_t(token.size()), ios_base::cur);
-    return {};
+shared_ptr<block_t>
+read_block_data(const shared_ptr<random_access_file_t> &file,
+                const block_info_t &block_info,
+                const shared_ptr<block_allocator_t> &allocator) {
+  shared_ptr<block_t> inblock;
+  if (const void *ptr =
+          file->map(block_info.data_begin, block_info.used_space)) {
+    // The file is held in memory; uncompressed data are not copied
+    inblock = make_shared<view_block_t>(ptr, block_info.used_space, file);
+  } else {
+    inblock = ndarray::make_input_block(block_info, allocator);
+    file->read(inblock->ptr(), inblock->nbytes(), block_info.data_begin);
   }
-  // header_size
-  uint16_t header_size;
-  input(is, header_size);
-  auto header_prefix_end = is.tellg();
+  return ndarray::decode_block(inblock, block_info, allocator);
+}
+
+// flags, compression, allocated_space, used_space, data_space, checksum
+constexpr uint16_t min_block_header_size = 4 + 4 + 8 + 8 + 8 + 16;
+
+// Parse a block header (without its magic token and header size)
+block_info_t parse_block_header(const array<unsigned char, 4> &token,
+                                uint16_t header_size,
+                                const vector<unsigned char> &header,
+                                int64_t block_begin) {
+  const unsigned char *header_ptr = header.data();
   // flags
   uint32_t flags;
-  input(is, flags);
-  assert(flags == 0);
+  input(header_ptr, flags);
+  assert((flags & ~block_flag_streamed) == 0);
   // compression
   array<unsigned char, 4> comp;
   for (auto &ch : comp)
-    input(is, ch);
+    input(header_ptr, ch);
   // TODO: Remember compression
   compression_t compression;
   if ((comp == array<unsigned char, 4>{0, 0, 0, 0}))
@@ -400,45 +490,153 @@ ndarray::read_block(const shared_ptr<istream> &pis) {
     compression = compression_t::zlib;
   else
     assert(0);
-  // allocated_space
+  // allocated_space (the size of the block's slot in the file)
   uint64_t allocated_space;
-  input(is, allocated_space);
-  // used_space
+  input(header_ptr, allocated_space);
+  // used_space (the size of the stored data)
   uint64_t used_space;
-  input(is, used_space);
-  assert(used_space >= allocated_space);
+  input(header_ptr, used_space);
+  assert(used_space <= allocated_space);
   // data_space
   uint64_t data_space;
-  input(is, data_space);
+  input(header_ptr, data_space);
   // checksum
   array<unsigned char, 16> checksum;
   for (auto &ch : checksum)
-    input(is, ch);
+    input(header_ptr, ch);
   // finish reading header
-  auto header_end = is.tellg();
-  int64_t header_read = header_end - header_prefix_end;
+  int64_t header_read = header_ptr - header.data();
   assert(header_read <= header_size);
-  if (header_read < header_size)
-    is.seekg(header_size - header_read, ios_base::cur);
-  // read data
-  auto block_begin = is.tellg();
-  auto fdata = memoized<block_t>([=]() {
-    return read_block_data(pis, block_begin, allocated_space, data_space,
-                           compression, checksum);
-  });
+  if (flags & block_flag_streamed)
+    assert(compression == compression_t::none);
+
+  return block_info_t{
+      token,       header_size,     header_read, flags,      comp,
+      compression, allocated_space, used_space,  data_space, checksum,
+      block_begin,
+  };
+}
+
+std::optional<block_info_t>
+ndarray::read_block_info(const shared_ptr<random_access_file_t> &file,
+                         int64_t &pos) {
+  // block_magic_token and header_size
+  array<unsigned char, 6> header_prefix;
+  const size_t prefix_read =
+      file->read_some(header_prefix.data(), header_prefix.size(), pos);
+  if (prefix_read < header_prefix.size())
+    return {};
+  const unsigned char *prefix_ptr = header_prefix.data();
+  array<unsigned char, 4> token;
+  for (auto &ch : token)
+    input(prefix_ptr, ch);
+  if (token != block_magic_token)
+    return {};
+  // header_size
+  uint16_t header_size;
+  input(prefix_ptr, header_size);
+  assert(header_size >= min_block_header_size);
+  vector<unsigned char> header(header_size);
+  file->read(header.data(), header.size(), pos + header_prefix.size());
+  const int64_t block_begin = pos + header_prefix.size() + header_size;
+  block_info_t block_info =
+      parse_block_header(token, header_size, header, block_begin);
+  if (block_info.flags & block_flag_streamed) {
+    // The data extend to the end of the file
+    const int64_t file_size = file->get_size();
+    assert(file_size >= block_begin);
+    block_info.allocated_space = block_info.used_space =
+        block_info.data_space = file_size - block_begin;
+  }
+
+  // skip padding
+  pos = block_begin + int64_t(block_info.allocated_space);
+
+  return block_info;
+}
+
+memoized<block_t>
+ndarray::make_block_data(const shared_ptr<random_access_file_t> &file,
+                         const block_info_t &block_info,
+                         const shared_ptr<block_allocator_t> &allocator) {
+  auto fdata = memoized<block_t>(
+      [=]() { return read_block_data(file, block_info, allocator); });
   // This would ensure synchronous reading, which might be useful for
   // debugging
   // fdata.fill_cache();
+  return fdata;
+}
 
-  // skip padding
-  is.seekg(block_begin + streamoff(used_space));
+std::tuple<memoized<block_t>, block_info_t>
+ndarray::read_block(const shared_ptr<random_access_file_t> &file,
+                    int64_t &pos,
+                    const shared_ptr<block_allocator_t> &allocator) {
+  const auto block_info = read_block_info(file, pos);
+  if (!block_info)
+    return {};
+  return {make_block_data(file, *block_info, allocator), *block_info};
+}
 
-  block_info_t block_info{
-      token,       header_size,     header_read, flags,      comp,
-      compression, allocated_space, used_space,  data_space, checksum,
-  };
+std::tuple<shared_ptr<block_t>, block_info_t>
+ndarray::read_block_sequential(istream &is, int64_t &pos,
+                               const shared_ptr<block_allocator_t> &allocator) {
+  // block_magic_token and header_size
+  array<unsigned char, 6> header_prefix;
+  is.read(reinterpret_cast<char *>(header_prefix.data()),
+          header_prefix.size());
+  if (is.gcount() < int64_t(header_prefix.size()))
+    return {};
+  const unsigned char *prefix_ptr = header_prefix.data();
+  array<unsigned char, 4> token;
+  for (auto &ch : token)
+    input(prefix_ptr, ch);
+  // This is e.g. the block index; we cannot put it back, but we do not need
+  // it either
+  if (token != block_magic_token)
+    return {};
+  // header_size
+  uint16_t header_size;
+  input(prefix_ptr, header_size);
+  assert(header_size >= min_block_header_size);
+  vector<unsigned char> header(header_size);
+  is.read(reinterpret_cast<char *>(header.data()), header.size());
+  assert(is);
+  const int64_t block_begin = pos + header_prefix.size() + header_size;
+  block_info_t block_info =
+      parse_block_header(token, header_size, header, block_begin);
+
+  if (block_info.flags & block_flag_streamed) {
+    // The data extend to the end of the stream
+    vector<unsigned char> data;
+    const size_t chunk_size = 1024 * 1024;
+    for (;;) {
+      const size_t old_size = data.size();
+      data.resize(old_size + chunk_size);
+      is.read(reinterpret_cast<char *>(data.data() + old_size), chunk_size);
+      data.resize(old_size + is.gcount());
+      if (!is)
+        break;
+    }
+    block_info.allocated_space = block_info.used_space =
+        block_info.data_space = data.size();
+    pos = block_begin + int64_t(data.size());
+    return {make_shared<typed_block_t<unsigned char>>(std::move(data)),
+            block_info};
+  }
 
-  return {fdata, block_info};
+  // read data
+  const shared_ptr<block_t> inblock = make_input_block(block_info, allocator);
+  is.read(static_cast<char *>(inblock->ptr()), inblock->nbytes());
+  assert(is);
+  const shared_ptr<block_t> data =
+      decode_block(inblock, block_info, allocator);
+
+  // skip padding
+  is.ignore(block_info.allocated_space - block_info.used_space);
+  assert(is);
+  pos = block_begin + int64_t(block_info.allocated_space);
+
+  return {data, block_info};
 }
 
 template <typename T>
@@ -450,9 +648,11 @@ void output(vector<unsigned char> &header, const T &data) {
     header.push_back((U(data) >> (8 * i)) & 0xff);
 }
 
-// TODO: stream the block (e.g. when compressing), then write the correct
-// header later
-void ndarray::write_block(ostream &os) const {
+vector<unsigned char>
+make_block_header(const array<unsigned char, 4> &comp, uint64_t allocated_space,
+                  uint64_t used_space, uint64_t data_space,
+                  const array<unsigned char, 16> &checksum,
+                  uint32_t flags = 0) {
   vector<unsigned char> header;
   // block_magic_token
   for (auto ch : block_magic_token)
@@ -463,20 +663,195 @@ void ndarray::write_block(ostream &os) const {
   output(header, unknown_header_size);
   auto header_prefix_length = header.size();
   // flags
-  uint32_t flags = 0;
   output(header, flags);
   // compression
-  array<unsigned char, 4> comp;
-  shared_ptr<block_t> outdata;
+  for (auto ch : comp)
+    output(header, ch);
+  // allocated_space
+  output(header, allocated_space);
+  // used_space
+  output(header, used_space);
+  // data_space
+  output(header, data_space);
+  // checksum
+  for (auto ch : checksum)
+    output(header, ch);
+
+  // fill in header_size
+  uint16_t header_size = header.size() - header_prefix_length;
+  vector<unsigned char> header_size_buf;
+  output(header_size_buf, header_size);
+  for (size_t p = 0; p < header_size_buf.size(); ++p)
+    header.at(header_size_pos + p) = header_size_buf.at(p);
+  return header;
+}
+
+array<unsigned char, 4> compression_token(compression_t compression) {
+  switch (compression) {
+  case compression_t::none:
+    return {0, 0, 0, 0};
+  case compression_t::blosc:
+    return {'b', 'l', 's', 'c'};
+  case compression_t::blosc2:
+    return {'b', 'l', 's', '2'};
+  case compression_t::bzip2:
+    return {'b', 'z', 'p', '2'};
+  case compression_t::liblz4:
+    return {'l', 'z', '4', 'f'};
+  case compression_t::libzstd:
+    return {'z', 's', 't', 'd'};
+  case compression_t::zlib:
+    return {'z', 'l', 'i', 'b'};
+  default:
+    assert(0);
+    return {0, 0, 0, 0};
+  }
+}
+
+// The checksum of the data as stored in a block
+array<unsigned char, 16> block_checksum(const block_t &outdata) {
+  return checksum({{outdata.ptr(), outdata.nbytes()}});
+}
+
+// The padding after `used_space` bytes of block data, see
+// `writer_options::block_slack`
+uint64_t slack_space(uint64_t used_space, double block_slack) {
+  assert(block_slack >= 0);
+  return uint64_t(std::ceil(used_space * block_slack));
+}
+
+void ndarray::write_block_streaming(output_sink_t &sink,
+                                    double block_slack) const {
+  // Write a preliminary header, stream the data, then go back and write the
+  // correct header. If the sink cannot seek, the data must be uncompressed;
+  // the header is then written only once, without a checksum.
+  const array<unsigned char, 4> comp = compression_token(compression);
+  const array<unsigned char, 16> no_checksum{0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 0, 0, 0, 0, 0, 0, 0};
+  const bool patch_header = sink.is_seekable();
+  assert(patch_header || compression == compression_t::none);
+  int64_t npoints = 1;
+  for (const int64_t sz : shape)
+    npoints *= sz;
+  const uint64_t known_nbytes =
+      patch_header ? 0 : npoints * datatype->type_size();
+  const int64_t header_pos = sink.tell();
+  vector<unsigned char> header = make_block_header(
+      comp, known_nbytes + slack_space(known_nbytes, block_slack),
+      known_nbytes, known_nbytes, no_checksum);
+  sink.write(header.data(), header.size());
+
+  block_writer_t writer(sink, compression, compression_level);
+  const int rank = shape.size();
+  const int64_t nrows = rank == 0 ? 1 : shape.at(0);
+  int64_t row_npoints = 1;
+  for (int d = 1; d < rank; ++d)
+    row_npoints *= shape.at(d);
+  const size_t row_nbytes = row_npoints * datatype->type_size();
+  vector<unsigned char> buffer(min(rows_per_chunk, nrows) * row_nbytes);
+  for (int64_t begin = 0; begin < nrows; begin += rows_per_chunk) {
+    const int64_t count = min(rows_per_chunk, nrows - begin);
+    generator(begin, count, buffer.data());
+    writer.write(buffer.data(), count * row_nbytes);
+  }
+  writer.finish();
+  const uint64_t used_space = writer.get_used_space();
+  const vector<unsigned char> padding(slack_space(used_space, block_slack));
+  sink.write(padding.data(), padding.size());
+
+  if (!patch_header) {
+    assert(writer.get_data_space() == known_nbytes);
+    return;
+  }
+  header = make_block_header(comp, used_space + padding.size(), used_space,
+                             writer.get_data_space(), writer.get_checksum());
+  sink.patch(header.data(), header.size(), header_pos);
+}
+
+void ndarray::write_block_streamed(output_sink_t &sink) const {
+  const array<unsigned char, 4> comp = compression_token(compression_t::none);
+  const array<unsigned char, 16> no_checksum{0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 0, 0, 0, 0, 0, 0, 0};
+  const vector<unsigned char> header =
+      make_block_header(comp, 0, 0, 0, no_checksum, block_flag_streamed);
+  sink.write(header.data(), header.size());
+
+  if (generator) {
+    const int rank = shape.size();
+    const int64_t nrows = rank == 0 ? 1 : shape.at(0);
+    int64_t row_npoints = 1;
+    for (int d = 1; d < rank; ++d)
+      row_npoints *= shape.at(d);
+    const size_t row_nbytes = row_npoints * datatype->type_size();
+    vector<unsigned char> buffer(min(rows_per_chunk, nrows) * row_nbytes);
+    for (int64_t begin = 0; begin < nrows; begin += rows_per_chunk) {
+      const int64_t count = min(rows_per_chunk, nrows - begin);
+      generator(begin, count, buffer.data());
+      sink.write(buffer.data(), count * row_nbytes);
+    }
+    return;
+  }
 
-  // storage management
   const bool old_ready = get_data().ready();
+  const shared_ptr<block_t> data = get_data().get();
+  sink.write(data->ptr(), data->nbytes());
+  if (!old_ready)
+    get_data().forget();
+}
+
+bool ndarray::is_contiguous() const {
+  int64_t str = datatype->type_size();
+  for (int d = int(shape.size()) - 1; d >= 0; --d) {
+    if (strides.at(d) != str)
+      return false;
+    str *= shape.at(d);
+  }
+  return true;
+}
+
+// The bitwise XOR of a block and the data of the delta base `base`, which
+// may begin anywhere in its block (e.g. in a shared block). Applying this
+// to a block and its delta base yields the delta, and vice versa.
+shared_ptr<block_t> delta_xor(const block_t &data, const ndarray &base) {
+  assert(base.is_contiguous());
+  int64_t nbytes = base.get_datatype()->type_size();
+  for (const int64_t sz : base.get_shape())
+    nbytes *= sz;
+  assert(int64_t(data.nbytes()) == nbytes);
+
+  // storage management
+  const bool old_ready = base.get_data().ready();
+  const shared_ptr<block_t> base_data = base.get_data().get();
+  assert(base.get_offset() + nbytes <= int64_t(base_data->nbytes()));
+  const auto result = make_shared<allocated_block_t>(
+      get_default_block_allocator(), data.nbytes());
+  const auto *const data_ptr = static_cast<const unsigned char *>(data.ptr());
+  const auto *const base_ptr =
+      static_cast<const unsigned char *>(base_data->ptr()) + base.get_offset();
+  auto *const result_ptr = static_cast<unsigned char *>(result->ptr());
+  for (size_t i = 0; i < data.nbytes(); ++i)
+    result_ptr[i] = data_ptr[i] ^ base_ptr[i];
+  if (!old_ready)
+    base.get_data().forget();
+  return result;
+}
+
+std::tuple<array<unsigned char, 4>, shared_ptr<block_t>>
+ndarray::encode_block() const {
+  // The data as stored, i.e. relative to the delta base
+  shared_ptr<block_t> data = get_data().get();
+  if (delta_base)
+    data = delta_xor(*data, *delta_base);
+
+  // compression
+  array<unsigned char, 4> comp;
+  shared_ptr<block_t> outdata;
 
   switch (compression) {
 
   case compression_t::none:
     comp = {0, 0, 0, 0};
-    outdata = get_data().get();
+    outdata = data;
     break;
 
 #ifdef ASDF_HAVE_BLOSC
@@ -489,21 +864,21 @@ void ndarray::write_block(ostream &os) const {
     const int blocksize = 0;
     const int numinternalthreads = 1;
 
-    assert(get_data()->nbytes() <= size_t(INT_MAX));
+    assert(data->nbytes() <= size_t(INT_MAX));
 
     // Allocate `BLOSC_MAX_OVERHEAD` more
     outdata = make_shared<typed_block_t<unsigned char>>(
-        vector<unsigned char>(get_data()->nbytes() + BLOSC_MAX_OVERHEAD));
+        vector<unsigned char>(data->nbytes() + BLOSC_MAX_OVERHEAD));
     int bytes_written =
-        blosc_compress_ctx(level, doshuffle, typesize, get_data()->nbytes(),
-                           get_data()->ptr(), outdata->ptr(), outdata->nbytes(),
+        blosc_compress_ctx(level, doshuffle, typesize, data->nbytes(),
+                           data->ptr(), outdata->ptr(), outdata->nbytes(),
                            compressor, blocksize, numinternalthreads);
     assert(bytes_written > 0);
     outdata->resize(bytes_written);
-    if (outdata->nbytes() >= get_data()->nbytes()) {
+    if (outdata->nbytes() >= data->nbytes()) {
       // Skip compression if it does not reduce the size
       comp = {0, 0, 0, 0};
-      outdata = get_data().get();
+      outdata = data;
     }
     break;
   }
@@ -529,8 +904,8 @@ void ndarray::write_block(ostream &os) const {
     blosc2_schunk *const schunk = blosc2_schunk_new(&storage);
 
     const int64_t chunk_size = INT_MAX - BLOSC2_MAX_OVERHEAD;
-    uint8_t *input_ptr = static_cast<uint8_t *>(get_data()->ptr());
-    int64_t total_input_size = get_data()->nbytes();
+    uint8_t *input_ptr = static_cast<uint8_t *>(data->ptr());
+    int64_t total_input_size = data->nbytes();
     while (total_input_size > 0) {
       using std::min;
       const int input_size = min(total_input_size, chunk_size);
@@ -563,7 +938,7 @@ void ndarray::write_block(ostream &os) const {
     comp = {'b', 'z', 'p', '2'};
     // Allocate 600 bytes plus 1% more
     outdata = make_shared<typed_block_t<unsigned char>>(vector<unsigned char>(
-        600 + get_data()->nbytes() + (get_data()->nbytes() + 99) / 100));
+        600 + data->nbytes() + (data->nbytes() + 99) / 100));
     const int level = compression_level;
     bz_stream strm;
     strm.bzalloc = NULL;
@@ -571,9 +946,9 @@ void ndarray::write_block(ostream &os) const {
     strm.opaque = NULL;
     BZ2_bzCompressInit(&strm, level, 0, 0);
     strm.next_in =
-        reinterpret_cast<char *>(const_cast<void *>(get_data()->ptr()));
+        reinterpret_cast<char *>(const_cast<void *>(data->ptr()));
     strm.next_out = reinterpret_cast<char *>(outdata->ptr());
-    uint64_t avail_in = get_data()->nbytes();
+    uint64_t avail_in = data->nbytes();
     uint64_t avail_out = outdata->nbytes();
     for (;;) {
       uint64_t this_avail_in =
@@ -592,10 +967,10 @@ void ndarray::write_block(ostream &os) const {
     }
     assert(avail_in == 0);
     outdata->resize(outdata->nbytes() - avail_out);
-    if (outdata->nbytes() >= get_data()->nbytes()) {
+    if (outdata->nbytes() >= data->nbytes()) {
       // Skip compression if it does not reduce the size
       comp = {0, 0, 0, 0};
-      outdata = get_data().get();
+      outdata = data;
     }
     break;
   }
@@ -609,13 +984,13 @@ void ndarray::write_block(ostream &os) const {
     preferences.compressionLevel = compression_level;
 
     const size_t max_nbytes =
-        LZ4F_compressFrameBound(get_data()->nbytes(), &preferences);
+        LZ4F_compressFrameBound(data->nbytes(), &preferences);
     outdata = make_shared<typed_block_t<unsigned char>>(
         vector<unsigned char>(max_nbytes));
 
     const size_t nbytes =
-        LZ4F_compressFrame(outdata->ptr(), outdata->nbytes(), get_data()->ptr(),
-                           get_data()->nbytes(), &preferences);
+        LZ4F_compressFrame(outdata->ptr(), outdata->nbytes(), data->ptr(),
+                           data->nbytes(), &preferences);
     outdata->resize(nbytes);
     break;
   }
@@ -626,8 +1001,8 @@ void ndarray::write_block(ostream &os) const {
     comp = {'z', 'l', 'i', 'b'};
     // Allocate 6 bytes plus 5 bytes per 16 kByte more
     outdata = make_shared<typed_block_t<unsigned char>>(
-        vector<unsigned char>((6 + get_data()->nbytes() +
-                               (get_data()->nbytes() + 16383) / 16384 * 5)));
+        vector<unsigned char>((6 + data->nbytes() +
+                               (data->nbytes() + 16383) / 16384 * 5)));
     const int level = compression_level;
     z_stream strm;
     strm.zalloc = Z_NULL;
@@ -636,9 +1011,9 @@ void ndarray::write_block(ostream &os) const {
     int iret = deflateInit(&strm, level);
     assert(iret == Z_OK);
     strm.next_in = reinterpret_cast<unsigned char *>(
-        const_cast<void *>(get_data()->ptr()));
+        const_cast<void *>(data->ptr()));
     strm.next_out = reinterpret_cast<unsigned char *>(outdata->ptr());
-    uint64_t avail_in = get_data()->nbytes();
+    uint64_t avail_in = data->nbytes();
     uint64_t avail_out = outdata->nbytes();
     for (;;) {
       uint64_t this_avail_in =
@@ -657,10 +1032,10 @@ void ndarray::write_block(ostream &os) const {
     }
     assert(avail_in == 0);
     outdata->resize(outdata->nbytes() - avail_out);
-    if (outdata->nbytes() >= get_data()->nbytes()) {
+    if (outdata->nbytes() >= data->nbytes()) {
       // Skip compression if it does not reduce the size
       comp = {0, 0, 0, 0};
-      outdata = get_data().get();
+      outdata = data;
     }
     break;
   }
@@ -670,58 +1045,88 @@ void ndarray::write_block(ostream &os) const {
     assert(0);
   }
 
-  for (auto ch : comp)
-    output(header, ch);
-  // allocated_space
-  uint64_t allocated_space = outdata->nbytes();
-  output(header, allocated_space);
+  return {comp, outdata};
+}
+
+void ndarray::write_block(output_sink_t &sink, double block_slack) const {
+  if (streamed) {
+    write_block_streamed(sink);
+    return;
+  }
+  // Compressed generated arrays are materialized if the sink cannot seek
+  if (generator && !delta_base && block_writer_t::can_stream(compression) &&
+      (sink.is_seekable() || compression == compression_t::none)) {
+    write_block_streaming(sink, block_slack);
+    return;
+  }
+
+  // storage management
+  const bool old_ready = get_data().ready();
+
+  const auto [comp, outdata] = encode_block();
+
   // used_space
-  uint64_t used_space = allocated_space; // no padding
-  output(header, used_space);
+  const uint64_t used_space = outdata->nbytes();
+  // allocated_space
+  const uint64_t allocated_space =
+      used_space + slack_space(used_space, block_slack);
   // data_space
-  uint64_t data_space = get_data()->nbytes();
-  output(header, data_space);
+  const uint64_t data_space = get_data()->nbytes();
 
-  // checksum
-  array<unsigned char, 16> checksum;
-#ifdef ASDF_HAVE_OPENSSL
-  EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-  assert(mdctx);
-  int ires = EVP_DigestInit_ex(mdctx, EVP_md5(), NULL);
-  assert(ires == 1);
-  ires = EVP_DigestUpdate(mdctx, outdata->ptr(), outdata->nbytes());
-  assert(ires == 1);
-  assert(EVP_MD_size(EVP_md5()) == checksum.size());
-  unsigned int digest_size;
-  ires = EVP_DigestFinal_ex(mdctx, checksum.data(), &digest_size);
-  assert(digest_size == checksum.size());
-  assert(ires == 1);
-  EVP_MD_CTX_free(mdctx);
-#else
-  checksum = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-#endif
-  for (auto ch : checksum)
-    output(header, ch);
+  const vector<unsigned char> header = make_block_header(
+      comp, allocated_space, used_space, data_space, block_checksum(*outdata));
+  const vector<unsigned char> padding(allocated_space - used_space);
+  // write header, data, and padding without concatenating them
+  sink.writev({{header.data(), header.size()},
+               {outdata->ptr(), outdata->nbytes()},
+               {padding.data(), padding.size()}});
 
-  // fill in header_size
-  uint16_t header_size = header.size() - header_prefix_length;
-  vector<unsigned char> header_size_buf;
-  output(header_size_buf, header_size);
-  for (size_t p = 0; p < header_size_buf.size(); ++p)
-    header.at(header_size_pos + p) = header_size_buf.at(p);
-  // write header
-  os.write(reinterpret_cast<const char *>(header.data()), header.size());
+  // storage management
+  if (!old_ready)
+    get_data().forget();
+}
+
+bool ndarray::overwrite_block(const string &filename, int64_t source) const {
+  return overwrite_block(*reader_state::open(filename), source);
+}
+
+bool ndarray::overwrite_block(const reader_state &rs, int64_t source) const {
+  assert(block_format == block_format_t::block);
+  assert(!streamed);
+
+  // Find the block
+  const string &filename = rs.get_filename();
+  assert(!filename.empty() && rs.get_file());
+  const block_info_t old_info = rs.get_block_info(source);
+  const int64_t file_size = rs.get_file()->get_size();
+  assert(!(old_info.flags & block_flag_streamed));
+
+  // storage management
+  const bool old_ready = get_data().ready();
 
-  // write data
-  os.write(reinterpret_cast<const char *>(outdata->ptr()), outdata->nbytes());
+  const auto [comp, outdata] = encode_block();
+  const uint64_t used_space = outdata->nbytes();
+  const uint64_t data_space = get_data()->nbytes();
+  // Keep the size of the slot, so that the following blocks stay in place
+  const vector<unsigned char> header =
+      make_block_header(comp, old_info.allocated_space, used_space,
+                        data_space, block_checksum(*outdata));
+  const int64_t header_begin =
+      old_info.data_begin - old_info.header_size - 6;
+  const bool fits = used_space <= old_info.allocated_space &&
+                    int64_t(header.size()) == 6 + old_info.header_size;
+  if (fits) {
+    // Do not truncate the file, since a streamed block might be growing
+    fd_sink_t sink(filename, file_size, false);
+    sink.patch(outdata->ptr(), outdata->nbytes(), old_info.data_begin);
+    sink.patch(header.data(), header.size(), header_begin);
+  }
 
   // storage management
   if (!old_ready)
     get_data().forget();
 
-  // write padding
-  vector<char> padding(allocated_space - used_space);
-  os.write(padding.data(), padding.size());
+  return fits;
 }
 
 ndarray::ndarray(const shared_ptr<reader_state> &rs, const YAML::Node &node)
@@ -741,16 +1146,40 @@ ndarray::ndarray(const shared_ptr<reader_state> &rs, const YAML::Node &node)
   case block_format_t::block: {
     int64_t source;
     yaml_decode(node["source"], source);
+    // Negative sources count from the end
+    if (source < 0)
+      source += rs->get_block_count();
     // TODO: This is just a default choice
     compression = compression_t::zlib;
     compression_level = 9;
     datatype = make_shared<datatype_t>(rs, node["datatype"]);
     yaml_decode(node["byteorder"], byteorder);
-    yaml_decode(node["shape"], shape);
+    const YAML::Node &shape_node = node["shape"];
+    streamed = shape_node.IsSequence() && shape_node.size() > 0 &&
+               shape_node[0].IsScalar() && shape_node[0].Scalar() == "*";
+    if (streamed) {
+      shape.resize(shape_node.size());
+      for (size_t d = 1; d < shape.size(); ++d)
+        yaml_decode(shape_node[d], shape[d]);
+    } else {
+      yaml_decode(shape_node, shape);
+    }
     if (node["offset"].IsDefined())
       yaml_decode(node["offset"], offset);
     else
       offset = 0;
+    if (streamed) {
+      // Infer the first dimension from the size of the block; a partially
+      // appended row is ignored
+      block_info = rs->get_block_info(source);
+      assert(block_info->flags & block_flag_streamed);
+      int64_t row_nbytes = datatype->type_size();
+      for (size_t d = 1; d < shape.size(); ++d)
+        row_nbytes *= shape[d];
+      assert(row_nbytes > 0);
+      const int64_t nbytes = int64_t(block_info->data_space) - offset;
+      shape[0] = max(int64_t(0), nbytes) / row_nbytes;
+    }
     if (node["strides"].IsDefined()) {
       yaml_decode(node["strides"], strides);
     } else {
@@ -763,7 +1192,19 @@ ndarray::ndarray(const shared_ptr<reader_state> &rs, const YAML::Node &node)
       }
     }
     mdata = rs->get_block(source);
-    block_info = std::make_optional<block_info_t>(rs->get_block_info(source));
+    if (node["delta_base"].IsDefined()) {
+      // The block holds the delta relative to another array
+      delta_base_ref = make_shared<reference>(rs, node["delta_base"]);
+      const memoized<block_t> delta = mdata;
+      const shared_ptr<reference> ref = delta_base_ref;
+      mdata = memoized<block_t>([=]() {
+        const auto [base_rs, base_node] = ref->resolve();
+        const ndarray base(base_rs, base_node);
+        return delta_xor(*delta.get(), base);
+      });
+    }
+    this->rs = rs;
+    this->source = source;
     break;
   }
 
@@ -796,23 +1237,317 @@ ndarray::ndarray(const shared_ptr<reader_state> &rs, const YAML::Node &node)
   }
 }
 
+void ndarray::load_data(const vector<shared_ptr<ndarray>> &arrays,
+                        const load_options &load_opts) {
+  // Group blocks by file
+  map<reader_state *, pair<shared_ptr<reader_state>, vector<int64_t>>> files;
+  for (const auto &arr : arrays) {
+    if (!arr->rs)
+      continue; // data are not read from a file
+    auto &file = files[arr->rs.get()];
+    file.first = arr->rs;
+    file.second.push_back(arr->source);
+  }
+  for (const auto &[ptr, file] : files)
+    file.first->load_blocks(file.second, load_opts);
+}
+
+ndarray::ndarray(row_generator_t generator1, int64_t rows_per_chunk,
+                 block_format_t block_format, compression_t compression,
+                 int compression_level, shared_ptr<datatype_t> datatype1,
+                 byteorder_t byteorder, vector<int64_t> shape1)
+    : ndarray(memoized<block_t>(), std::optional<block_info_t>(), block_format,
+              compression, compression_level, vector<bool>(),
+              std::move(datatype1), byteorder, std::move(shape1)) {
+  assert(generator1);
+  assert(rows_per_chunk > 0);
+  generator = std::move(generator1);
+  this->rows_per_chunk = rows_per_chunk;
+  // The data are only materialized if they are accessed as a whole
+  const row_generator_t gen = generator;
+  const int rank = shape.size();
+  const int64_t nrows = rank == 0 ? 1 : shape.at(0);
+  int64_t row_npoints = 1;
+  for (int d = 1; d < rank; ++d)
+    row_npoints *= shape.at(d);
+  const size_t row_nbytes = row_npoints * datatype->type_size();
+  mdata = memoized<block_t>([=]() {
+    const auto data = make_shared<allocated_block_t>(
+        get_default_block_allocator(), nrows * row_nbytes);
+    unsigned char *const ptr = static_cast<unsigned char *>(data->ptr());
+    for (int64_t begin = 0; begin < nrows; begin += rows_per_chunk)
+      gen(begin, min(rows_per_chunk, nrows - begin),
+          ptr + begin * row_nbytes);
+    return shared_ptr<block_t>(data);
+  });
+}
+
+chunk_iterator_t ndarray::get_chunks(int64_t rows_per_chunk) const {
+  return chunk_iterator_t(*this, rows_per_chunk);
+}
+
+chunk_iterator_t::chunk_iterator_t(const ndarray &arr, int64_t rows_per_chunk)
+    : offset(arr.offset), rows_per_chunk(rows_per_chunk), begin(0), count(0),
+      chunk_ptr(nullptr) {
+  assert(rows_per_chunk > 0);
+  const int rank = arr.shape.size();
+  nrows = rank == 0 ? 1 : arr.shape.at(0);
+  int64_t row_npoints = 1;
+  for (int d = 1; d < rank; ++d)
+    row_npoints *= arr.shape.at(d);
+  row_nbytes = row_npoints * arr.datatype->type_size();
+  // Check that the array is C-contiguous
+  int64_t str = arr.datatype->type_size();
+  for (int d = rank - 1; d >= 0; --d) {
+    assert(arr.strides.at(d) == str);
+    str *= arr.shape.at(d);
+  }
+  if (nrows == 0)
+    return;
+
+  const auto block_info = arr.get_block_info();
+  if (arr.rs && arr.rs->get_file() && !arr.delta_base_ref &&
+      !arr.mdata.ready() &&
+      block_reader_t::can_stream(block_info->compression)) {
+    reader = make_unique<block_reader_t>(arr.rs->get_file(), *block_info);
+    const int64_t max_rows = min(rows_per_chunk, nrows);
+    buffer = make_shared<allocated_block_t>(arr.rs->get_options().allocator,
+                                            max_rows * row_nbytes);
+    // Skip the offset
+    int64_t skip = offset;
+    vector<unsigned char> scratch(min(skip, int64_t(64 * 1024)));
+    while (skip > 0) {
+      const size_t nbytes = reader->read(
+          scratch.data(), min(int64_t(scratch.size()), skip));
+      assert(nbytes > 0);
+      skip -= nbytes;
+    }
+  } else if (arr.generator && !arr.mdata.ready()) {
+    generator = arr.generator;
+    const int64_t max_rows = min(rows_per_chunk, nrows);
+    buffer = make_shared<allocated_block_t>(get_default_block_allocator(),
+                                            max_rows * row_nbytes);
+  } else {
+    data = arr.mdata.get();
+  }
+}
+
+bool chunk_iterator_t::next() {
+  begin += count;
+  if (begin >= nrows) {
+    count = 0;
+    chunk_ptr = nullptr;
+    return false;
+  }
+  count = min(rows_per_chunk, nrows - begin);
+  if (reader) {
+    const size_t nread = reader->read(buffer->ptr(), nbytes());
+    assert(nread == nbytes());
+    chunk_ptr = static_cast<const unsigned char *>(buffer->ptr());
+  } else if (generator) {
+    generator(begin, count, buffer->ptr());
+    chunk_ptr = static_cast<const unsigned char *>(buffer->ptr());
+  } else {
+    assert(offset + (begin + count) * row_nbytes <= data->nbytes());
+    chunk_ptr = static_cast<const unsigned char *>(data->ptr()) + offset +
+                begin * row_nbytes;
+  }
+  return true;
+}
+
 ndarray::ndarray(const copy_state &cs, const ndarray &arr) : ndarray(arr) {
   if (cs.set_block_format)
     block_format = cs.block_format;
+  if (block_format != block_format_t::block)
+    streamed = false;
   if (cs.set_compression)
     compression = cs.compression;
   if (cs.set_compression_level)
     compression_level = cs.compression_level;
+  // Data that are not yet loaded from a file stay where they are, unless
+  // the file is about to be overwritten
+  const bool from_file = rs && !arr.mdata.ready();
+  if (cs.copy_data &&
+      (!from_file || same_file(rs->get_filename(), cs.overwritten_file))) {
+    // Take a snapshot of the data
+    const bool old_ready = arr.get_data().ready();
+    const shared_ptr<block_t> data = arr.get_data().get();
+    const auto snapshot = make_shared<allocated_block_t>(
+        get_default_block_allocator(), data->nbytes());
+    if (data->nbytes() > 0)
+      std::memcpy(snapshot->ptr(), data->ptr(), data->nbytes());
+    if (!old_ready)
+      arr.get_data().forget();
+    mdata = make_constant_memoized(shared_ptr<block_t>(snapshot));
+    generator = nullptr;
+    rows_per_chunk = 0;
+    // The snapshot no longer refers to the file's block
+    rs = nullptr;
+    source = -1;
+    // Data read from a file are already reconstructed from their delta
+    if (!delta_base)
+      delta_base_ref = nullptr;
+  }
+  // The delta is taken relative to a snapshot of the base as well
+  if (cs.copy_data && delta_base)
+    delta_base = make_shared<ndarray>(cs, *delta_base);
+}
+
+namespace {
+string to_hex(const void *ptr) {
+  ostringstream buf;
+  buf << ptr;
+  return buf.str();
+}
+
+// Forget data that were loaded for writing once the last copy of the
+// returned handle is gone, i.e. after their block has been written or the
+// writer has been discarded
+shared_ptr<void> forget_later(const memoized<block_t> &data) {
+  return shared_ptr<void>(nullptr, [data](void *) { data.forget(); });
+}
+
+bool same_data(const ndarray &arr1, const ndarray &arr2) {
+  // storage management
+  const bool old_ready1 = arr1.get_data().ready();
+  const bool old_ready2 = arr2.get_data().ready();
+  const shared_ptr<block_t> data1 = arr1.get_data().get();
+  const shared_ptr<block_t> data2 = arr2.get_data().get();
+  const bool same =
+      data1->nbytes() == data2->nbytes() &&
+      (data1->nbytes() == 0 ||
+       std::memcmp(data1->ptr(), data2->ptr(), data1->nbytes()) == 0);
+  if (!old_ready1)
+    arr1.get_data().forget();
+  if (!old_ready2)
+    arr2.get_data().forget();
+  return same;
+}
+} // namespace
+
+size_t ndarray::data_hash() const {
+  // Equal hashes are confirmed by comparing the data (see `same_data`), so
+  // that a fast, non-cryptographic hash suffices
+  const shared_ptr<block_t> data = get_data().get();
+  return hash<string_view>()(
+      string_view(static_cast<const char *>(data->ptr()), data->nbytes()));
+}
+
+int64_t ndarray::get_block_nbytes() const {
+  if (!get_data().ready()) {
+    if (const auto block_info = get_block_info())
+      return block_info->data_space;
+    if (generator) {
+      int64_t npoints = 1;
+      for (const int64_t sz : shape)
+        npoints *= sz;
+      return npoints * datatype->type_size();
+    }
+  }
+  // storage management
+  const bool old_ready = get_data().ready();
+  const int64_t nbytes = get_data()->nbytes();
+  if (!old_ready)
+    get_data().forget();
+  return nbytes;
+}
+
+void ndarray::write_pack(output_sink_t &sink, const block_pack_t &pack,
+                         compression_t compression, int compression_level,
+                         double block_slack) {
+  vector<unsigned char> data(pack.nbytes, 0);
+  for (const auto &[pack_offset, arr] : pack.arrays) {
+    // storage management
+    const bool old_ready = arr->get_data().ready();
+    const shared_ptr<block_t> arr_data = arr->get_data().get();
+    assert(pack_offset + int64_t(arr_data->nbytes()) <= pack.nbytes);
+    if (arr_data->nbytes() > 0)
+      std::memcpy(data.data() + pack_offset, arr_data->ptr(),
+                  arr_data->nbytes());
+    if (!old_ready)
+      arr->get_data().forget();
+  }
+  const int64_t nbytes = data.size();
+  const ndarray packed(std::move(data), block_format_t::block, compression,
+                       compression_level, {}, {nbytes});
+  packed.write_block(sink, block_slack);
 }
 
 writer &ndarray::to_yaml(writer &w) const {
   w << YAML::LocalTag("core/ndarray-1.0.0");
   w << YAML::BeginMap;
+  // The offset of the data in the block, if the block is shared
+  int64_t block_offset = 0;
   if (block_format == block_format_t::block) {
     // source
-    const auto &self = *this;
-    uint64_t idx = w.add_task([=](ostream &os) { self.write_block(os); });
+    // Blocks that are already in the file (when appending) are kept
+    int64_t idx = rs ? w.get_existing_block(*rs, source) : -1;
+    // Existing blocks keep their encoding
+    const bool delta_encoded =
+        idx >= 0 ? bool(delta_base_ref) : bool(delta_base);
+    // Blocks with identical content are written only once. Arrays sharing
+    // their data are recognized right away; others by their content hash.
+    string id_key, content_key;
+    // Data loaded for hashing stay loaded until their block is written
+    shared_ptr<void> loaded;
+    if (idx < 0 && !streamed) {
+      ostringstream encoding;
+      encoding << " " << int(compression) << " " << compression_level << " "
+               << delta_base.get();
+      id_key = "id " + to_hex(mdata.get_id()) + encoding.str();
+      tie(idx, block_offset) =
+          w.find_block(id_key, [](const ndarray &) { return true; });
+      if (idx < 0 && w.get_deduplicate_blocks() && !delta_base) {
+        if (!get_data().ready())
+          loaded = forget_later(get_data());
+        content_key = "hash " + to_string(data_hash()) + encoding.str();
+        tie(idx, block_offset) =
+            w.find_block(content_key, [&](const ndarray &other) {
+              return same_data(*this, other);
+            });
+      }
+    }
+    const bool new_block = idx < 0;
+    // The writer keeps a copy of the array, which shares its data
+    const auto self = new_block ? make_shared<const ndarray>(*this) : nullptr;
+    const double block_slack = w.get_block_slack();
+    if (idx < 0 && !streamed && !delta_base && w.get_pack_threshold() > 0) {
+      // Small arrays share blocks with other arrays that are encoded alike
+      const int64_t nbytes = get_block_nbytes();
+      if (nbytes <= w.get_pack_threshold()) {
+        ostringstream pack_key;
+        pack_key << int(compression) << " " << compression_level;
+        const compression_t compression = this->compression;
+        const int compression_level = this->compression_level;
+        tie(idx, block_offset) = w.add_to_pack(
+            pack_key.str(), nbytes, self,
+            [=](const shared_ptr<const block_pack_t> &pack) {
+              return [=](output_sink_t &sink) {
+                write_pack(sink, *pack, compression, compression_level,
+                           block_slack);
+              };
+            });
+      }
+    }
+    if (idx < 0) {
+      const auto task = [=](output_sink_t &sink) {
+        self->write_block(sink, block_slack);
+        // The data stay loaded while the task exists
+        (void)loaded;
+      };
+      // A streamed block is the last block (source -1)
+      idx = streamed ? w.add_streamed_task(task) : w.add_task(task);
+    }
+    if (new_block) {
+      if (!id_key.empty())
+        w.add_block_key(id_key, idx, block_offset, self);
+      if (!content_key.empty())
+        w.add_block_key(content_key, idx, block_offset, self);
+    }
     w << YAML::Key << "source" << YAML::Value << idx;
+    // delta_base (an extension of the ndarray schema)
+    if (delta_encoded)
+      w << YAML::Key << "delta_base" << YAML::Value << *delta_base_ref;
   } else {
     // data
     w << YAML::Key << "data" << YAML::Value
@@ -829,10 +1564,19 @@ writer &ndarray::to_yaml(writer &w) const {
     w << YAML::Key << "byteorder" << YAML::Value << yaml_encode(byteorder);
   }
   // shape
-  w << YAML::Key << "shape" << YAML::Value << YAML::Flow << shape;
+  w << YAML::Key << "shape" << YAML::Value << YAML::Flow;
+  if (streamed) {
+    // The first dimension grows as data are appended
+    w << YAML::BeginSeq << "*";
+    for (size_t d = 1; d < shape.size(); ++d)
+      w << shape[d];
+    w << YAML::EndSeq;
+  } else {
+    w << shape;
+  }
   if (block_format == block_format_t::block) {
     // offset
-    w << YAML::Key << "offset" << YAML::Value << offset;
+    w << YAML::Key << "offset" << YAML::Value << block_offset + offset;
     // strides
     w << YAML::Key << "strides" << YAML::Value << YAML::Flow << strides;
   }
@@ -0,0 +1,658 @@
+#include <asdf/stream.hxx>
+
+#include <asdf/config.hxx>
+#include <asdf/ndarray.hxx>
+
+#ifdef ASDF_HAVE_BZIP2
+#include <bzlib.h>
+#endif
+
+#ifdef ASDF_HAVE_LIBLZ4
+#include <lz4frame.h>
+#ifndef LZ4F_HEADER_SIZE_MAX
+#define LZ4F_HEADER_SIZE_MAX 19
+#endif
+#endif
+
+#ifdef ASDF_HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#ifdef ASDF_HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#ifdef ASDF_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+namespace ASDF {
+
+// Incremental decoding of block data
+
+class stream_decoder_t {
+public:
+  virtual ~stream_decoder_t() {}
+
+  // Decompress from `in` to `out`, advancing the pointers and decreasing the
+  // available sizes. Return true when the end of the stream has been reached.
+  virtual bool decode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail) = 0;
+};
+
+namespace {
+
+class none_decoder_t : public stream_decoder_t {
+public:
+  virtual ~none_decoder_t() {}
+
+  virtual bool decode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail) override {
+    const size_t n = min(in_avail, out_avail);
+    memcpy(out, in, n);
+    in += n;
+    in_avail -= n;
+    out += n;
+    out_avail -= n;
+    // The caller detects the end of the data
+    return false;
+  }
+};
+
+#ifdef ASDF_HAVE_BZIP2
+class bzip2_decoder_t : public stream_decoder_t {
+  bz_stream strm;
+
+public:
+  bzip2_decoder_t() {
+    strm.bzalloc = NULL;
+    strm.bzfree = NULL;
+    strm.opaque = NULL;
+    int iret = BZ2_bzDecompressInit(&strm, 0, 0);
+    assert(iret == BZ_OK);
+  }
+  virtual ~bzip2_decoder_t() { BZ2_bzDecompressEnd(&strm); }
+
+  virtual bool decode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail) override {
+    const size_t this_avail_in =
+        min(size_t(numeric_limits<unsigned int>::max()), in_avail);
+    const size_t this_avail_out =
+        min(size_t(numeric_limits<unsigned int>::max()), out_avail);
+    strm.next_in = reinterpret_cast<char *>(const_cast<unsigned char *>(in));
+    strm.next_out = reinterpret_cast<char *>(out);
+    strm.avail_in = this_avail_in;
+    strm.avail_out = this_avail_out;
+    int iret = BZ2_bzDecompress(&strm);
+    assert(iret == BZ_OK || iret == BZ_STREAM_END);
+    in += this_avail_in - strm.avail_in;
+    in_avail -= this_avail_in - strm.avail_in;
+    out += this_avail_out - strm.avail_out;
+    out_avail -= this_avail_out - strm.avail_out;
+    return iret == BZ_STREAM_END;
+  }
+};
+#endif
+
+#ifdef ASDF_HAVE_LIBLZ4
+class liblz4_decoder_t : public stream_decoder_t {
+  LZ4F_dctx *dctx;
+
+public:
+  liblz4_decoder_t() {
+    LZ4F_errorCode_t ierr =
+        LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+    assert(!LZ4F_isError(ierr));
+  }
+  virtual ~liblz4_decoder_t() { LZ4F_freeDecompressionContext(dctx); }
+
+  virtual bool decode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail) override {
+    size_t dstSize = out_avail;
+    size_t srcSize = in_avail;
+    const size_t nbytes_expected =
+        LZ4F_decompress(dctx, out, &dstSize, in, &srcSize, nullptr);
+    assert(!LZ4F_isError(nbytes_expected));
+    in += srcSize;
+    in_avail -= srcSize;
+    out += dstSize;
+    out_avail -= dstSize;
+    return nbytes_expected == 0;
+  }
+};
+#endif
+
+#ifdef ASDF_HAVE_LIBZSTD
+class libzstd_decoder_t : public stream_decoder_t {
+  ZSTD_DStream *zds;
+
+public:
+  libzstd_decoder_t() {
+    zds = ZSTD_createDStream();
+    assert(zds);
+    const size_t ierr = ZSTD_initDStream(zds);
+    assert(!ZSTD_isError(ierr));
+  }
+  virtual ~libzstd_decoder_t() { ZSTD_freeDStream(zds); }
+
+  virtual bool decode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail) override {
+    ZSTD_inBuffer input{in, in_avail, 0};
+    ZSTD_outBuffer output{out, out_avail, 0};
+    const size_t iret = ZSTD_decompressStream(zds, &output, &input);
+    assert(!ZSTD_isError(iret));
+    in += input.pos;
+    in_avail -= input.pos;
+    out += output.pos;
+    out_avail -= output.pos;
+    return iret == 0;
+  }
+};
+#endif
+
+#ifdef ASDF_HAVE_ZLIB
+class zlib_decoder_t : public stream_decoder_t {
+  z_stream strm;
+
+public:
+  zlib_decoder_t() {
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.next_in = Z_NULL;
+    strm.avail_in = 0;
+    int iret = inflateInit(&strm);
+    assert(iret == Z_OK);
+  }
+  virtual ~zlib_decoder_t() { inflateEnd(&strm); }
+
+  virtual bool decode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail) override {
+    const size_t this_avail_in =
+        min(size_t(numeric_limits<uInt>::max()), in_avail);
+    const size_t this_avail_out =
+        min(size_t(numeric_limits<uInt>::max()), out_avail);
+    strm.next_in = const_cast<unsigned char *>(in);
+    strm.next_out = out;
+    strm.avail_in = this_avail_in;
+    strm.avail_out = this_avail_out;
+    int iret = inflate(&strm, Z_NO_FLUSH);
+    assert(iret == Z_OK || iret == Z_STREAM_END || iret == Z_BUF_ERROR);
+    in += this_avail_in - strm.avail_in;
+    in_avail -= this_avail_in - strm.avail_in;
+    out += this_avail_out - strm.avail_out;
+    out_avail -= this_avail_out - strm.avail_out;
+    return iret == Z_STREAM_END;
+  }
+};
+#endif
+
+unique_ptr<stream_decoder_t> make_stream_decoder(compression_t compression) {
+  switch (compression) {
+  case compression_t::none:
+    return make_unique<none_decoder_t>();
+#ifdef ASDF_HAVE_BZIP2
+  case compression_t::bzip2:
+    return make_unique<bzip2_decoder_t>();
+#endif
+#ifdef ASDF_HAVE_LIBLZ4
+  case compression_t::liblz4:
+    return make_unique<liblz4_decoder_t>();
+#endif
+#ifdef ASDF_HAVE_LIBZSTD
+  case compression_t::libzstd:
+    return make_unique<libzstd_decoder_t>();
+#endif
+#ifdef ASDF_HAVE_ZLIB
+  case compression_t::zlib:
+    return make_unique<zlib_decoder_t>();
+#endif
+  default:
+    assert(0);
+    return nullptr;
+  }
+}
+
+} // namespace
+
+class stream_checksum_t {
+#ifdef ASDF_HAVE_OPENSSL
+  EVP_MD_CTX *mdctx;
+#endif
+
+public:
+  stream_checksum_t() {
+#ifdef ASDF_HAVE_OPENSSL
+    mdctx = EVP_MD_CTX_new();
+    assert(mdctx);
+    int ires = EVP_DigestInit_ex(mdctx, EVP_md5(), NULL);
+    assert(ires == 1);
+#endif
+  }
+  ~stream_checksum_t() {
+#ifdef ASDF_HAVE_OPENSSL
+    EVP_MD_CTX_free(mdctx);
+#endif
+  }
+
+  void update(const unsigned char *ptr, size_t nbytes) {
+#ifdef ASDF_HAVE_OPENSSL
+    int ires = EVP_DigestUpdate(mdctx, ptr, nbytes);
+    assert(ires == 1);
+#endif
+  }
+
+  // The checksum is all zeros if checksums are not supported
+  array<unsigned char, 16> get() {
+    array<unsigned char, 16> checksum{0, 0, 0, 0, 0, 0, 0, 0,
+                                      0, 0, 0, 0, 0, 0, 0, 0};
+#ifdef ASDF_HAVE_OPENSSL
+    assert(size_t(EVP_MD_size(EVP_md5())) == checksum.size());
+    unsigned int digest_size;
+    int ires = EVP_DigestFinal_ex(mdctx, checksum.data(), &digest_size);
+    assert(ires == 1);
+    assert(digest_size == checksum.size());
+#endif
+    return checksum;
+  }
+
+  void check(const array<unsigned char, 16> &want_checksum) {
+#ifdef ASDF_HAVE_OPENSSL
+    assert(get() == want_checksum);
+#endif
+  }
+};
+
+array<unsigned char, 16> checksum(const vector<write_buffer_t> &buffers) {
+  stream_checksum_t checksum;
+  for (const auto &buffer : buffers)
+    checksum.update(static_cast<const unsigned char *>(buffer.buf),
+                    buffer.nbytes);
+  return checksum.get();
+}
+
+block_reader_t::block_reader_t(shared_ptr<random_access_file_t> file1,
+                               const block_info_t &block_info,
+                               size_t buffer_size)
+    : file(std::move(file1)), in_pos(block_info.data_begin),
+      in_end(block_info.data_begin + int64_t(block_info.used_space)),
+      data_space(block_info.data_space), out_pos(0),
+      want_checksum(block_info.checksum), inbuf(buffer_size), in_ptr(nullptr),
+      in_avail(0), decoder(make_stream_decoder(block_info.compression)) {
+  assert(file);
+  assert(buffer_size > 0);
+  if (block_info.compression == compression_t::none)
+    assert(block_info.data_space == block_info.used_space);
+#ifdef ASDF_HAVE_OPENSSL
+  if (want_checksum != array<unsigned char, 16>{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                0, 0, 0, 0, 0})
+    checksum = make_unique<stream_checksum_t>();
+#endif
+}
+
+block_reader_t::block_reader_t(block_reader_t &&) = default;
+block_reader_t &block_reader_t::operator=(block_reader_t &&) = default;
+block_reader_t::~block_reader_t() {}
+
+bool block_reader_t::can_stream(compression_t compression) {
+  switch (compression) {
+  case compression_t::none:
+    return true;
+#ifdef ASDF_HAVE_BZIP2
+  case compression_t::bzip2:
+    return true;
+#endif
+#ifdef ASDF_HAVE_LIBLZ4
+  case compression_t::liblz4:
+    return true;
+#endif
+#ifdef ASDF_HAVE_LIBZSTD
+  case compression_t::libzstd:
+    return true;
+#endif
+#ifdef ASDF_HAVE_ZLIB
+  case compression_t::zlib:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+void block_reader_t::refill() {
+  assert(in_avail == 0);
+  if (const void *ptr = file->map(in_pos, in_end - in_pos)) {
+    // The file is held in memory; use the data directly
+    in_ptr = static_cast<const unsigned char *>(ptr);
+    in_avail = in_end - in_pos;
+    assert(in_avail > 0); // unexpected end of the compressed data
+    if (checksum)
+      checksum->update(in_ptr, in_avail);
+    in_pos = in_end;
+    return;
+  }
+  const size_t nbytes = size_t(min(int64_t(inbuf.size()), in_end - in_pos));
+  assert(nbytes > 0); // unexpected end of the compressed data
+  file->read(inbuf.data(), nbytes, in_pos);
+  if (checksum)
+    checksum->update(inbuf.data(), nbytes);
+  in_pos += nbytes;
+  in_ptr = inbuf.data();
+  in_avail = nbytes;
+}
+
+void block_reader_t::finish() {
+  // Include the remaining compressed data (if any) in the checksum
+  while (in_pos < in_end) {
+    in_avail = 0;
+    refill();
+  }
+  in_avail = 0;
+  if (checksum) {
+    checksum->check(want_checksum);
+    checksum.reset();
+  }
+}
+
+size_t block_reader_t::read(void *buf, size_t nbytes) {
+  unsigned char *out_ptr = static_cast<unsigned char *>(buf);
+  size_t out_avail = size_t(min(uint64_t(nbytes), data_space - out_pos));
+  const size_t want = out_avail;
+  bool stream_end = false;
+  while (out_avail > 0 && !stream_end) {
+    if (in_avail == 0 && in_pos < in_end)
+      refill();
+    const bool have_input = in_avail > 0;
+    const size_t old_out_avail = out_avail;
+    stream_end = decoder->decode(in_ptr, in_avail, out_ptr, out_avail);
+    // The compressed data must not end before the decompressed data
+    assert(stream_end || have_input || out_avail < old_out_avail);
+  }
+  const size_t nread = want - out_avail;
+  out_pos += nread;
+  if (stream_end)
+    assert(out_pos == data_space);
+  if (out_pos == data_space && (checksum || in_pos < in_end))
+    finish();
+  return nread;
+}
+
+// Incremental encoding of block data
+
+class stream_encoder_t {
+public:
+  virtual ~stream_encoder_t() {}
+
+  // Compress from `in` to `out`, advancing the pointers and decreasing the
+  // available sizes. With `finish`, all input has been passed in, and the
+  // encoder should write its remaining output; return true when it is done.
+  // The encoder may make no progress if `out_avail` is too small.
+  virtual bool encode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail,
+                      bool finish) = 0;
+};
+
+namespace {
+
+class none_encoder_t : public stream_encoder_t {
+public:
+  virtual ~none_encoder_t() {}
+
+  virtual bool encode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail,
+                      bool finish) override {
+    const size_t n = min(in_avail, out_avail);
+    memcpy(out, in, n);
+    in += n;
+    in_avail -= n;
+    out += n;
+    out_avail -= n;
+    return finish && in_avail == 0;
+  }
+};
+
+#ifdef ASDF_HAVE_BZIP2
+class bzip2_encoder_t : public stream_encoder_t {
+  bz_stream strm;
+
+public:
+  bzip2_encoder_t(int level) {
+    strm.bzalloc = NULL;
+    strm.bzfree = NULL;
+    strm.opaque = NULL;
+    int iret = BZ2_bzCompressInit(&strm, level, 0, 0);
+    assert(iret == BZ_OK);
+  }
+  virtual ~bzip2_encoder_t() { BZ2_bzCompressEnd(&strm); }
+
+  virtual bool encode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail,
+                      bool finish) override {
+    const size_t this_avail_in =
+        min(size_t(numeric_limits<unsigned int>::max()), in_avail);
+    const size_t this_avail_out =
+        min(size_t(numeric_limits<unsigned int>::max()), out_avail);
+    strm.next_in = reinterpret_cast<char *>(const_cast<unsigned char *>(in));
+    strm.next_out = reinterpret_cast<char *>(out);
+    strm.avail_in = this_avail_in;
+    strm.avail_out = this_avail_out;
+    const bool last = finish && this_avail_in == in_avail;
+    int iret = BZ2_bzCompress(&strm, last ? BZ_FINISH : BZ_RUN);
+    assert(iret == BZ_RUN_OK || iret == BZ_FINISH_OK || iret == BZ_STREAM_END);
+    in += this_avail_in - strm.avail_in;
+    in_avail -= this_avail_in - strm.avail_in;
+    out += this_avail_out - strm.avail_out;
+    out_avail -= this_avail_out - strm.avail_out;
+    return iret == BZ_STREAM_END;
+  }
+};
+#endif
+
+#ifdef ASDF_HAVE_LIBLZ4
+class liblz4_encoder_t : public stream_encoder_t {
+  LZ4F_cctx *cctx;
+  LZ4F_preferences_t preferences;
+  bool started;
+  // Compress at most this much input at once
+  static constexpr size_t max_in_nbytes = 64 * 1024;
+
+public:
+  liblz4_encoder_t(int level) : preferences(LZ4F_INIT_PREFERENCES) {
+    preferences.compressionLevel = level;
+    LZ4F_errorCode_t ierr = LZ4F_createCompressionContext(&cctx, LZ4F_VERSION);
+    assert(!LZ4F_isError(ierr));
+    started = false;
+  }
+  virtual ~liblz4_encoder_t() { LZ4F_freeCompressionContext(cctx); }
+
+  virtual bool encode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail,
+                      bool finish) override {
+    if (!started) {
+      if (out_avail < LZ4F_HEADER_SIZE_MAX)
+        return false;
+      const size_t nbytes =
+          LZ4F_compressBegin(cctx, out, out_avail, &preferences);
+      assert(!LZ4F_isError(nbytes));
+      out += nbytes;
+      out_avail -= nbytes;
+      started = true;
+    }
+    while (in_avail > 0) {
+      const size_t this_avail_in = min(max_in_nbytes, in_avail);
+      if (out_avail < LZ4F_compressBound(this_avail_in, &preferences))
+        return false;
+      const size_t nbytes = LZ4F_compressUpdate(cctx, out, out_avail, in,
+                                                this_avail_in, nullptr);
+      assert(!LZ4F_isError(nbytes));
+      in += this_avail_in;
+      in_avail -= this_avail_in;
+      out += nbytes;
+      out_avail -= nbytes;
+    }
+    if (!finish)
+      return false;
+    if (out_avail < LZ4F_compressBound(0, &preferences))
+      return false;
+    const size_t nbytes = LZ4F_compressEnd(cctx, out, out_avail, nullptr);
+    assert(!LZ4F_isError(nbytes));
+    out += nbytes;
+    out_avail -= nbytes;
+    return true;
+  }
+};
+#endif
+
+#ifdef ASDF_HAVE_ZLIB
+class zlib_encoder_t : public stream_encoder_t {
+  z_stream strm;
+
+public:
+  zlib_encoder_t(int level) {
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    int iret = deflateInit(&strm, level);
+    assert(iret == Z_OK);
+  }
+  virtual ~zlib_encoder_t() { deflateEnd(&strm); }
+
+  virtual bool encode(const unsigned char *&in, size_t &in_avail,
+                      unsigned char *&out, size_t &out_avail,
+                      bool finish) override {
+    const size_t this_avail_in =
+        min(size_t(numeric_limits<uInt>::max()), in_avail);
+    const size_t this_avail_out =
+        min(size_t(numeric_limits<uInt>::max()), out_avail);
+    strm.next_in = const_cast<unsigned char *>(in);
+    strm.next_out = out;
+    strm.avail_in = this_avail_in;
+    strm.avail_out = this_avail_out;
+    const bool last = finish && this_avail_in == in_avail;
+    int iret = deflate(&strm, last ? Z_FINISH : Z_NO_FLUSH);
+    assert(iret == Z_OK || iret == Z_STREAM_END || iret == Z_BUF_ERROR);
+    in += this_avail_in - strm.avail_in;
+    in_avail -= this_avail_in - strm.avail_in;
+    out += this_avail_out - strm.avail_out;
+    out_avail -= this_avail_out - strm.avail_out;
+    return iret == Z_STREAM_END;
+  }
+};
+#endif
+
+unique_ptr<stream_encoder_t> make_stream_encoder(compression_t compression,
+                                                 int compression_level) {
+  switch (compression) {
+  case compression_t::none:
+    return make_unique<none_encoder_t>();
+#ifdef ASDF_HAVE_BZIP2
+  case compression_t::bzip2:
+    return make_unique<bzip2_encoder_t>(compression_level);
+#endif
+#ifdef ASDF_HAVE_LIBLZ4
+  case compression_t::liblz4:
+    return make_unique<liblz4_encoder_t>(compression_level);
+#endif
+#ifdef ASDF_HAVE_ZLIB
+  case compression_t::zlib:
+    return make_unique<zlib_encoder_t>(compression_level);
+#endif
+  default:
+    assert(0);
+    return nullptr;
+  }
+}
+
+} // namespace
+
+block_writer_t::block_writer_t(output_sink_t &sink, compression_t compression,
+                               int compression_level, size_t buffer_size)
+    : sink(sink), in_nbytes(0), out_nbytes(0), finished(false),
+      outbuf(buffer_size), out_ptr(outbuf.data()), out_avail(outbuf.size()),
+      encoder(make_stream_encoder(compression, compression_level)),
+      checksum(make_unique<stream_checksum_t>()),
+      final_checksum{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0} {
+  // The buffer must be able to hold the output for the largest piece of input
+  // any encoder handles at once
+  assert(buffer_size >= 256 * 1024);
+}
+
+block_writer_t::~block_writer_t() {}
+
+bool block_writer_t::can_stream(compression_t compression) {
+  switch (compression) {
+  case compression_t::none:
+    return true;
+#ifdef ASDF_HAVE_BZIP2
+  case compression_t::bzip2:
+    return true;
+#endif
+#ifdef ASDF_HAVE_LIBLZ4
+  case compression_t::liblz4:
+    return true;
+#endif
+#ifdef ASDF_HAVE_ZLIB
+  case compression_t::zlib:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+void block_writer_t::flush() {
+  const size_t nbytes = out_ptr - outbuf.data();
+  if (nbytes == 0)
+    return;
+  sink.write(outbuf.data(), nbytes);
+  checksum->update(outbuf.data(), nbytes);
+  out_nbytes += nbytes;
+  out_ptr = outbuf.data();
+  out_avail = outbuf.size();
+}
+
+void block_writer_t::write(const void *buf, size_t nbytes) {
+  assert(!finished);
+  const unsigned char *in_ptr = static_cast<const unsigned char *>(buf);
+  size_t in_avail = nbytes;
+  while (in_avail > 0) {
+    const size_t old_in_avail = in_avail;
+    const size_t old_out_avail = out_avail;
+    encoder->encode(in_ptr, in_avail, out_ptr, out_avail, false);
+    const bool progress =
+        in_avail < old_in_avail || out_avail < old_out_avail;
+    if (out_avail == 0 || !progress) {
+      // The output buffer is full, or too full to make progress
+      assert(progress || out_avail < outbuf.size());
+      flush();
+    }
+  }
+  in_nbytes += nbytes;
+}
+
+void block_writer_t::finish() {
+  assert(!finished);
+  const unsigned char *in_ptr = nullptr;
+  size_t in_avail = 0;
+  for (;;) {
+    const size_t old_out_avail = out_avail;
+    const bool done =
+        encoder->encode(in_ptr, in_avail, out_ptr, out_avail, true);
+    if (done)
+      break;
+    if (out_avail == 0 || out_avail == old_out_avail) {
+      assert(out_avail < outbuf.size());
+      flush();
+    }
+  }
+  flush();
+  final_checksum = checksum->get();
+  finished = true;
+}
+
+} // namespace ASDF
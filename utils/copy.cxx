@@ -21,13 +21,15 @@ int main(int argc, char **argv) {
     cerr << msg << "Syntax: " << argv[0]
          << " [--array=(blockinline)] "
             "[--compression=(none|blosc|blosc2|bzip2|libzstd|zlib)] "
-            "[--compression-level=[0-9]] <input file> <output file>\n"
+            "[--compression-level=[0-9]] [--resolve-references] "
+            "<input file> <output file>\n"
          << "Aborting.\n";
     exit(1);
   };
   block_format_t block_format = block_format_t::undefined;
   compression_t compression = compression_t::undefined;
   int compression_level = -1;
+  bool resolve_references = false;
   vector<string> args;
   for (int argi = 1; argi < argc; ++argi)
     args.push_back(argv[argi]);
@@ -85,6 +87,10 @@ int main(int argc, char **argv) {
       compression_level = 8;
     } else if (opt == "--compression-level=9") {
       compression_level = 9;
+    } else if (opt == "--resolve-references") {
+      // Fold references to other files (e.g. earlier checkpoints) into a
+      // standalone file
+      resolve_references = true;
     } else {
       assert(0);
     }
@@ -100,12 +106,13 @@ int main(int argc, char **argv) {
   auto project = asdf(inputfilename);
 
   // Copy project
-  const copy_state cs{block_format != block_format_t::undefined,
-                      block_format,
-                      compression != compression_t::undefined,
-                      compression,
-                      compression_level != -1,
-                      compression_level};
+  copy_state cs{block_format != block_format_t::undefined,
+                block_format,
+                compression != compression_t::undefined,
+                compression,
+                compression_level != -1,
+                compression_level};
+  cs.resolve_references = resolve_references;
   auto project2 = project.copy(cs);
 
   // Write project
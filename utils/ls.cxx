@@ -15,6 +15,9 @@ using namespace std;
 
 const int indent_step = 2;
 
+// Output only the tree, without reading block headers
+bool tree_only = false;
+
 void output(std::ostream &os, const int indent,
             const std::shared_ptr<entry> &ent);
 void output(std::ostream &os, const int indent,
@@ -44,6 +47,15 @@ void output(std::ostream &os, const int indent,
 
 void output(std::ostream &os, const int indent,
             const std::shared_ptr<ndarray> &arr) {
+  if (tree_only) {
+    os << std::string(indent, ' ') << "ndarray:\n";
+    os << std::string(indent + indent_step, ' ') << "shape: [";
+    const auto shape = arr->get_shape();
+    for (size_t d = 0; d < shape.size(); ++d)
+      os << (d == 0 ? "" : ", ") << shape[d];
+    os << "]\n";
+    return;
+  }
   const auto block_info = *arr->get_block_info();
   os << std::string(indent, ' ') << "block_info:\n";
   os << std::string(indent + indent_step, ' ')
@@ -118,7 +130,13 @@ int main(int argc, char **argv) {
   }
 #endif
 
-  for (int arg = 1; arg < argc; ++arg) {
+  int argi = 1;
+  if (argi < argc && string(argv[argi]) == "--tree-only") {
+    tree_only = true;
+    ++argi;
+  }
+
+  for (int arg = argi; arg < argc; ++arg) {
     string filename = argv[arg];
     assert(!filename.empty());
 
@@ -130,7 +148,10 @@ int main(int argc, char **argv) {
     cout << node << "\n";
 
     // Output block info
-    const auto project = std::make_shared<asdf>(filename);
+    reader_options options;
+    options.tree_only = tree_only;
+    const auto project = std::make_shared<asdf>(
+        filename, map<string, asdf::reader_t>(), options);
     output(std::cout, 0, project);
   }
 